@@ -0,0 +1,348 @@
+#include "ApiCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>   // getenv()
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "NeoServer.h"
+
+/// The file is a Header, then each table in turn, then the text they all
+/// point into. Every record is a multiple of four bytes, so each table
+/// stays aligned.
+struct ApiTable::Header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t functions, params, classes;
+  uint32_t strings;     ///< Bytes of text.
+  uint64_t hash;        ///< Of the metadata blob this was built from.
+};
+
+namespace {
+  const char     magic[8] = "cvimapi";
+  const uint32_t version  = 1;
+
+  struct FuncRecord
+  {
+    uint32_t id;
+    uint32_t name, nameLen;
+    uint32_t result, resultLen;
+    uint32_t firstParam, params;
+    uint32_t canFail;
+  };
+
+  struct ParamRecord
+  {
+    uint32_t type, typeLen;
+    uint32_t name, nameLen;
+  };
+
+  struct ClassRecord
+  {
+    uint32_t name, nameLen;
+  };
+
+  /// Where each table starts, for a header's counts.
+  struct Offsets
+  {
+    size_t funcs, params, classes, byName, text, end;
+
+    Offsets(uint32_t f, uint32_t p, uint32_t c, uint32_t s)
+    {
+      funcs   = sizeof(ApiTable::Header);
+      params  = funcs   + f * sizeof(FuncRecord);
+      classes = params  + p * sizeof(ParamRecord);
+      byName  = classes + c * sizeof(ClassRecord);
+      text    = byName  + f * sizeof(uint32_t);
+      end     = text    + s;
+    }
+  };
+}
+
+ApiTable::~ApiTable()
+{
+  if (mapped)
+    munmap(mapped, length);
+}
+
+const ApiTable::Header &ApiTable::header() const
+{
+  return *reinterpret_cast<const Header *>(data);
+}
+
+std::string ApiTable::path_for(uint64_t hash)
+{
+  std::string dir;
+  if (const char *xdg = getenv("XDG_CACHE_HOME"))
+    dir = xdg;
+  else if (const char *home = getenv("HOME"))
+    dir = std::string(home) + "/.cache";
+  else
+    return "";
+
+  char name[32];
+  snprintf(name, sizeof name, "/cvim/api-%016llx", (unsigned long long) hash);
+  return dir + name;
+}
+
+bool ApiTable::valid(uint64_t hash) const
+{
+  if (length < sizeof(Header))
+    return false;
+  const Header &h = header();
+  return std::memcmp(h.magic, magic, sizeof magic) == 0
+      && h.version == version && h.hash == hash
+      && Offsets(h.functions, h.params, h.classes, h.strings).end == length;
+}
+
+bool ApiTable::load(uint64_t hash)
+{
+  std::string path = path_for(hash);
+  int fd = path.empty() ? -1 : open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  void *p = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return false;
+
+  mapped = p;
+  data   = static_cast<const char *>(p);
+  length = st.st_size;
+  if (valid(hash))
+    return true;
+
+  munmap(mapped, length);
+  mapped = nullptr;
+  data   = nullptr;
+  length = 0;
+  return false;
+}
+
+void ApiTable::build(uint64_t hash, const std::vector<std::string> &classes,
+                     const std::vector<NeoFunc> &functions)
+{
+  std::string text;
+  auto add = [&](const std::string &s, uint32_t &offset, uint32_t &len) {
+    offset = text.size();
+    len    = s.size();
+    text  += s;
+  };
+
+  std::vector<FuncRecord>  funcs;
+  std::vector<ParamRecord> params;
+  std::vector<ClassRecord> classRecs;
+
+  for (const NeoFunc &nf : functions) {
+    FuncRecord r;
+    r.id         = nf.id;
+    r.canFail    = nf.canFail;
+    r.firstParam = params.size();
+    r.params     = nf.args.size();
+    add(nf.name, r.name, r.nameLen);
+    add(nf.resultType, r.result, r.resultLen);
+    funcs.push_back(r);
+
+    for (const NeoFunc::Param &a : nf.args) {
+      ParamRecord pr;
+      add(a.type, pr.type, pr.typeLen);
+      add(a.name, pr.name, pr.nameLen);
+      params.push_back(pr);
+    }
+  }
+
+  for (const std::string &c : classes) {
+    ClassRecord cr;
+    add(c, cr.name, cr.nameLen);
+    classRecs.push_back(cr);
+  }
+
+  std::vector<uint32_t> byName(funcs.size());
+  for (size_t i = 0; i < byName.size(); i++)
+    byName[i] = i;
+  std::sort(std::begin(byName), std::end(byName), [&](uint32_t a, uint32_t b) {
+    return functions[a].name < functions[b].name;
+  });
+
+  Header h;
+  std::memcpy(h.magic, magic, sizeof magic);
+  h.version   = version;
+  h.functions = funcs.size();
+  h.params    = params.size();
+  h.classes   = classRecs.size();
+  h.strings   = text.size();
+  h.hash      = hash;
+
+  Offsets o(h.functions, h.params, h.classes, h.strings);
+  owned.assign(o.end, '\0');
+  std::memcpy(&owned[0], &h, sizeof h);
+  auto put = [&](size_t at, const void *p, size_t n) {
+    if (n)
+      std::memcpy(&owned[at], p, n);
+  };
+  put(o.funcs,   funcs.data(),     funcs.size()     * sizeof(FuncRecord));
+  put(o.params,  params.data(),    params.size()    * sizeof(ParamRecord));
+  put(o.classes, classRecs.data(), classRecs.size() * sizeof(ClassRecord));
+  put(o.byName,  byName.data(),    byName.size()    * sizeof(uint32_t));
+  put(o.text,    text.data(),      text.size());
+
+  if (mapped)
+    munmap(mapped, length);
+  mapped = nullptr;
+  data   = owned.data();
+  length = owned.size();
+
+  // Save it, without letting a reader see half a file. If the cache can't
+  // be written, we just parse again next time.
+  std::string path = path_for(hash);
+  if (path.empty())
+    return;
+  std::string dir = path.substr(0, path.rfind('/'));
+  mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0755);
+  mkdir(dir.c_str(), 0755);
+
+  std::string tmp = path + '.' + std::to_string(getpid());
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return;
+
+  size_t done = 0;
+  while (done < owned.size()) {
+    ssize_t n = write(fd, owned.data() + done, owned.size() - done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  close(fd);
+
+  if (done != owned.size() || rename(tmp.c_str(), path.c_str()) != 0)
+    unlink(tmp.c_str());
+}
+
+size_t ApiTable::size() const
+{
+  return data ? header().functions : 0;
+}
+
+size_t ApiTable::class_count() const
+{
+  return data ? header().classes : 0;
+}
+
+std::string ApiTable::text(uint32_t offset, uint32_t len) const
+{
+  const Header &h = header();
+  if (offset > h.strings || len > h.strings - offset)
+    return "";
+  size_t at = Offsets(h.functions, h.params, h.classes, h.strings).text;
+  return std::string(data + at + offset, len);
+}
+
+static const FuncRecord &func_record(const char *data, size_t offset, size_t i)
+{
+  return reinterpret_cast<const FuncRecord *>(data + offset)[i];
+}
+
+std::string ApiTable::name(size_t i) const
+{
+  const Header &h = header();
+  Offsets o(h.functions, h.params, h.classes, h.strings);
+  const FuncRecord &r = func_record(data, o.funcs, i);
+  return text(r.name, r.nameLen);
+}
+
+uint32_t ApiTable::id(size_t i) const
+{
+  const Header &h = header();
+  Offsets o(h.functions, h.params, h.classes, h.strings);
+  return func_record(data, o.funcs, i).id;
+}
+
+std::string ApiTable::class_name(size_t i) const
+{
+  const Header &h = header();
+  Offsets o(h.functions, h.params, h.classes, h.strings);
+  const ClassRecord &r =
+    reinterpret_cast<const ClassRecord *>(data + o.classes)[i];
+  return text(r.name, r.nameLen);
+}
+
+NeoFunc ApiTable::function(size_t i) const
+{
+  const Header &h = header();
+  Offsets o(h.functions, h.params, h.classes, h.strings);
+  const FuncRecord &r = func_record(data, o.funcs, i);
+
+  NeoFunc nf;
+  nf.id         = r.id;
+  nf.canFail    = r.canFail;
+  nf.name       = text(r.name, r.nameLen);
+  nf.resultType = text(r.result, r.resultLen);
+
+  const ParamRecord *params =
+    reinterpret_cast<const ParamRecord *>(data + o.params);
+  for (uint32_t p = r.firstParam; p < r.firstParam + r.params && p < h.params;
+       p++)
+    nf.args.push_back({text(params[p].type, params[p].typeLen),
+                       text(params[p].name, params[p].nameLen)});
+  return nf;
+}
+
+uint32_t ApiTable::find(const std::string &name) const
+{
+  if (!data)
+    return 0;
+
+  const Header &h = header();
+  Offsets o(h.functions, h.params, h.classes, h.strings);
+  const uint32_t *byName = reinterpret_cast<const uint32_t *>(data + o.byName);
+  const char *strings = data + o.text;
+
+  // Compares function i's name with `name`, as std::string would.
+  auto compare = [&](uint32_t i) {
+    const FuncRecord &r = func_record(data, o.funcs, i);
+    if (r.name > h.strings || r.nameLen > h.strings - r.name)
+      return -1;
+    int c = std::memcmp(strings + r.name, name.data(),
+                        std::min<size_t>(r.nameLen, name.size()));
+    if (c)
+      return c;
+    return r.nameLen < name.size() ? -1 : r.nameLen > name.size() ? 1 : 0;
+  };
+
+  size_t lo = 0, hi = h.functions;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    uint32_t i = byName[mid];
+    if (i >= h.functions)
+      return 0;
+    int c = compare(i);
+    if (c == 0)
+      return func_record(data, o.funcs, i).id;
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return 0;
+}
+
+uint64_t hash_bytes(const char *p, size_t n)
+{
+  uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < n; i++) {
+    h ^= (unsigned char) p[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
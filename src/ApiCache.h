@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct NeoFunc;
+
+/// nvim's API metadata, in a form that's usable as it lies in a file.
+///
+/// Decoding the metadata blob nvim sends on connect, with its maps of
+/// maps, costs more than the connection itself. So the first time a blob is
+/// seen, it is parsed once and saved as flat tables of fixed-size records
+/// and a sorted name index, in $XDG_CACHE_HOME/cvim (or ~/.cache/cvim),
+/// under a hash of the blob. After that, connecting only hashes the blob and
+/// mmap()s the file; a method is found by binary search, and NeoFuncs are
+/// only built when something asks for them.
+struct ApiTable
+{
+  ApiTable() = default;
+  ~ApiTable();
+
+  ApiTable(const ApiTable&) = delete;
+  ApiTable &operator= (const ApiTable&) = delete;
+
+  /// Maps the table saved for `hash`, if there is one and it's intact.
+  bool load(uint64_t hash);
+
+  /// Builds a table from parsed metadata, and saves it for next time.
+  void build(uint64_t hash, const std::vector<std::string> &classes,
+             const std::vector<NeoFunc> &functions);
+
+  /// The file a table for `hash` is saved in.
+  static std::string path_for(uint64_t hash);
+
+  size_t size() const;          ///< The number of functions.
+  size_t class_count() const;
+
+  std::string name(size_t i) const;
+  uint32_t id(size_t i) const;
+  std::string class_name(size_t i) const;
+
+  /// Decodes function `i` in full.
+  NeoFunc function(size_t i) const;
+
+  /// The id of the function called `name`, or zero if there's none.
+  uint32_t find(const std::string &name) const;
+
+  struct Header;                ///< Starts a table; see ApiCache.cpp.
+
+private:
+  const char *data = nullptr;
+  size_t length = 0;
+  void *mapped = nullptr;       ///< What to munmap(), if data is a file.
+  std::string owned;            ///< What data points into, if it isn't.
+
+  const Header &header() const;
+  std::string text(uint32_t offset, uint32_t len) const;
+
+  /// Checks a table's size and counts against its length.
+  bool valid(uint64_t hash) const;
+};
+
+/// FNV-1a, for telling metadata blobs apart.
+uint64_t hash_bytes(const char *p, size_t n);
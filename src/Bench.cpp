@@ -0,0 +1,241 @@
+#include "Bench.h"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <iomanip>
+#include <random>
+#include <thread>  // std::this_thread::sleep_until()
+
+#include <pthread.h>
+
+using Clock = std::chrono::steady_clock;
+
+/// The load and measurements of one connection.
+struct Worker
+{
+  NeoServer *serv;
+  const std::vector<BenchCall> *mix;
+  const BenchOptions *opts;
+
+  Clock::time_point start, stop, finish;
+  std::vector<BenchStats> stats;  ///< Parallel to `mix`.
+
+  std::mt19937 rng;
+  std::discrete_distribution<size_t> pick;
+
+  /// A call sent in open-loop mode, waiting for its reply.
+  struct Sent
+  {
+    uint64_t id;
+    size_t call;
+    Clock::time_point due;
+  };
+
+  std::deque<Sent> sent;
+  bool done = false;
+  pthread_mutex_t sentLock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t  newSent  = PTHREAD_COND_INITIALIZER;
+
+  pthread_t sender, collector;
+  bool sending = false, collecting = false;  ///< Which threads started.
+
+  uint64_t send(size_t call)
+  {
+    return serv->request_with((*mix)[call].method, (*mix)[call].args);
+  }
+
+  void record(size_t call, uint64_t id, Clock::time_point since)
+  {
+    bool failed;
+    serv->grab(id, &failed);
+    std::chrono::duration<double> d = Clock::now() - since;
+    stats[call].latencies.push_back(d.count());
+    stats[call].errors += failed;
+  }
+};
+
+static void *closed_loop(void *p)
+{
+  Worker &w = *static_cast<Worker *>(p);
+  Clock::time_point now;
+  while ((now = Clock::now()) < w.stop) {
+    size_t call = w.pick(w.rng);
+    w.record(call, w.send(call), now);
+  }
+  w.finish = Clock::now();
+  return nullptr;
+}
+
+static void *open_loop_send(void *p)
+{
+  Worker &w = *static_cast<Worker *>(p);
+  std::chrono::duration<double> interval(1 / w.opts->rate);
+
+  for (uint64_t k = 0; ; k++) {
+    auto due = w.start + std::chrono::duration_cast<Clock::duration>(k * interval);
+    if (due >= w.stop)
+      break;
+    std::this_thread::sleep_until(due);
+
+    size_t call = w.pick(w.rng);
+    uint64_t id = w.send(call);
+
+    ScopedLock l(w.sentLock);
+    w.sent.push_back({id, call, due});
+    pthread_cond_signal(&w.newSent);
+  }
+
+  ScopedLock l(w.sentLock);
+  w.done = true;
+  pthread_cond_signal(&w.newSent);
+  return nullptr;
+}
+
+static void *open_loop_collect(void *p)
+{
+  Worker &w = *static_cast<Worker *>(p);
+  while (true) {
+    Worker::Sent s;
+    {
+      ScopedLock l(w.sentLock);
+      while (w.sent.empty() && !w.done)
+        pthread_cond_wait(&w.newSent, &w.sentLock);
+      if (w.sent.empty())
+        break;
+      s = w.sent.front();
+      w.sent.pop_front();
+    }
+    w.record(s.call, s.id, s.due);
+  }
+  w.finish = Clock::now();
+  return nullptr;
+}
+
+/// The latency below which a fraction `p` of the (sorted) samples fall.
+static double percentile(const std::vector<double> &sorted, double p)
+{
+  if (sorted.empty())
+    return 0;
+  size_t i = (size_t) std::ceil(p * sorted.size());
+  return sorted[std::min(sorted.size(), std::max(i, (size_t) 1)) - 1];
+}
+
+bool run_bench(std::vector<std::unique_ptr<NeoServer>> &conns,
+               const std::vector<BenchCall> &mix,
+               const BenchOptions &opts, std::ostream &out)
+{
+  // discrete_distribution would pick a call that isn't there.
+  std::vector<double> weights;
+  for (const BenchCall &c : mix)
+    weights.push_back(c.weight);
+  if (std::all_of(std::begin(weights), std::end(weights),
+                  [](double w) { return w <= 0; })) {
+    std::cerr << "Nothing to benchmark: no call in the mix has a weight.\n";
+    return false;
+  }
+
+  bool open = opts.rate > 0;
+  Clock::time_point start = Clock::now();
+  Clock::time_point stop  = start +
+    std::chrono::duration_cast<Clock::duration>(opts.duration);
+
+  std::vector<Worker> workers(conns.size());
+  for (size_t i = 0; i < conns.size(); i++) {
+    Worker &w = workers[i];
+    w.serv  = conns[i].get();
+    w.mix   = &mix;
+    w.opts  = &opts;
+    w.start = start;
+    w.stop  = stop;
+    w.stats.resize(mix.size());
+    w.rng.seed(i + 1);
+    w.pick  = std::discrete_distribution<size_t>(std::begin(weights),
+                                                 std::end(weights));
+
+    if (open) {
+      w.collecting = pthread_create(&w.collector, nullptr,
+                                    open_loop_collect, &w) == 0;
+      w.sending = w.collecting
+                  && pthread_create(&w.sender, nullptr, open_loop_send,
+                                    &w) == 0;
+      if (w.collecting && !w.sending) {
+        // Let the collector see there's nothing coming.
+        ScopedLock l(w.sentLock);
+        w.done = true;
+        pthread_cond_signal(&w.newSent);
+      }
+    } else {
+      w.sending = pthread_create(&w.sender, nullptr, closed_loop, &w) == 0;
+    }
+    if (!w.sending)
+      std::cerr << "Connection " << i << " left out: couldn't start its "
+                << "threads with pthread_create()\n";
+  }
+
+  Clock::time_point finish = start;
+  size_t running = 0;
+  for (Worker &w : workers) {
+    if (w.sending)
+      pthread_join(w.sender, nullptr);
+    if (w.collecting)
+      pthread_join(w.collector, nullptr);
+    if (w.sending) {
+      finish = std::max(finish, w.finish);
+      running++;
+    }
+  }
+  if (running == 0) {
+    std::cerr << "No connection could start.\n";
+    return false;
+  }
+
+  // Merge every connection's samples, per method.
+  std::vector<BenchStats> total(mix.size());
+  for (Worker &w : workers) {
+    for (size_t c = 0; c < mix.size(); c++) {
+      std::vector<double> &l = total[c].latencies;
+      l.insert(std::end(l), std::begin(w.stats[c].latencies),
+                            std::end(w.stats[c].latencies));
+      total[c].errors += w.stats[c].errors;
+    }
+  }
+
+  std::chrono::duration<double> elapsed = finish - start;
+  size_t calls = 0, errors = 0;
+
+  out << running << " connections, ";
+  if (open)
+    out << "open-loop at " << opts.rate << " calls/s each, ";
+  else
+    out << "closed-loop, ";
+  out << std::fixed << std::setprecision(1) << elapsed.count() << "s\n\n";
+
+  out << std::left << std::setw(32) << "method" << std::right
+      << std::setw(10) << "calls" << std::setw(8) << "errors"
+      << std::setw(10) << "p50 ms" << std::setw(10) << "p99 ms"
+      << std::setw(10) << "p999 ms" << '\n';
+
+  out << std::setprecision(3);
+  for (size_t c = 0; c < mix.size(); c++) {
+    std::vector<double> &l = total[c].latencies;
+    std::sort(std::begin(l), std::end(l));
+    calls  += l.size();
+    errors += total[c].errors;
+
+    std::string name = mix[c].name;
+    for (const std::string &w : mix[c].words)
+      name += ' ' + w;
+
+    out << std::left << std::setw(32) << name << std::right
+        << std::setw(10) << l.size() << std::setw(8) << total[c].errors
+        << std::setw(10) << percentile(l, 0.5)   * 1e3
+        << std::setw(10) << percentile(l, 0.99)  * 1e3
+        << std::setw(10) << percentile(l, 0.999) * 1e3 << '\n';
+  }
+
+  out << '\n' << calls << " calls, " << std::setprecision(1)
+      << calls / elapsed.count() << " calls/s, " << errors << " errors\n";
+  out.flush();
+  return true;
+}
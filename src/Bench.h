@@ -0,0 +1,49 @@
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "NeoServer.h"
+
+/// One kind of call in a benchmark's mix.
+struct BenchCall
+{
+  std::string name;
+  uint64_t method;
+  unsigned weight = 1;                ///< How often, relative to the others.
+  std::vector<std::string> words;     ///< The arguments, as typed.
+  std::vector<msgpack::object> args;  ///< The arguments, as sent.
+};
+
+struct BenchOptions
+{
+  /// Calls per second, per connection. Zero means closed-loop: each
+  /// connection sends its next call as soon as the last one is answered.
+  double rate = 0;
+
+  std::chrono::duration<double> duration = std::chrono::seconds(10);
+};
+
+/// What was measured for one method.
+struct BenchStats
+{
+  std::vector<double> latencies;  ///< In seconds, one per reply.
+  size_t errors = 0;
+};
+
+/// Sends a random mix of calls on every connection at once until the time is
+/// up, then writes throughput, errors and latency percentiles per method to
+/// `out`.
+///
+/// In open-loop mode, calls go out on schedule whether or not earlier ones
+/// were answered, and latency is measured from when a call was due, so a
+/// stalled server shows up in the tail instead of just slowing the load.
+///
+/// @returns false, having said why on stderr, if the mix has no call with
+///          any weight, or no connection could start.
+bool run_bench(std::vector<std::unique_ptr<NeoServer>> &conns,
+               const std::vector<BenchCall> &mix,
+               const BenchOptions &, std::ostream &out);
@@ -0,0 +1,205 @@
+#include "BufferMirror.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+BufferMirror::BufferMirror(NeoServer &serv, size_t above, size_t below)
+  : serv(serv), above(above), below(below)
+{
+}
+
+BufferMirror::~BufferMirror()
+{
+  if (prefetch.id)
+    serv.discard(prefetch.id);
+}
+
+bool BufferMirror::update()
+{
+  using std::to_string;
+
+  collect_prefetch();
+
+  // The range we want, clamped to the buffer, as vimscript expressions.
+  std::string lo = "max([1, line('.') - " + to_string(above) + "])";
+  std::string hi = "line('.') + " + to_string(below);
+
+  // Our lines are still good if nothing changed and they cover the range.
+  std::string fresh =
+      "bufnr('%') == " + to_string(buffer) +
+      " && b:changedtick == " + to_string(tick) +
+      " && " + lo + " >= " + to_string(first + 1) +
+      " && min([line('$'), " + hi + "]) <= " + to_string(first + lines.size());
+
+  std::string expr =
+      "[bufnr('%'), b:changedtick, line('.'), col('.') - 1, line('$'), "
+      "winnr(), mode(), (" + fresh + ") ? 0 : getline(" + lo + ", " + hi + "), "
+      "(mode() ==# 'c' && getcmdtype() =~# '[/?]') ? getcmdline() : '', "
+      "&ignorecase, &smartcase]";
+
+  Clock::time_point sent = Clock::now();
+  msgpack::object o = serv.grab(serv.request("vim_eval", expr));
+  rtt = (rtt + (Clock::now() - sent)) / 2;
+
+  if (o.type != msgpack::type::ARRAY || o.via.array.size != 11)
+    return false;
+
+  msgpack::object_array ar = o.via.array;
+  buffer = ar.ptr[0].as<uint64_t>();
+  tick   = ar.ptr[1].as<uint64_t>();
+  cursor = { ar.ptr[2].as<int>(), ar.ptr[3].as<int>() };
+  length = ar.ptr[4].as<size_t>();
+  winnr  = ar.ptr[5].as<int>();
+  mode   = ar.ptr[6].as<std::string>();
+  search = ar.ptr[8].as<std::string>();
+  ignorecase = ar.ptr[9].as<int>() != 0;
+  smartcase  = ar.ptr[10].as<int>() != 0;
+
+  bool fetched = take_lines(ar.ptr[7]);
+  track_speed();
+  start_prefetch();
+  return fetched;
+}
+
+bool BufferMirror::update(uint64_t window)
+{
+  using std::to_string;
+
+  uint64_t bufId = serv.request("window_get_buffer", window);
+  uint64_t curId = serv.request("window_get_cursor", window);
+
+  uint64_t b = serv.grab(bufId).as<uint64_t>();
+  serv.grab(curId, cursor);
+  winnr = 0;
+
+  // What we hold is for another buffer, or already knows where it ends.
+  size_t end = cursor.first + below;
+  if (b == buffer)
+    end = std::min(end, length);
+
+  std::string buf = to_string(b);
+  std::string lo  = to_string(cursor.first > (int) above
+                              ? cursor.first - above : 1);
+  std::string hi  = to_string(end);
+
+  std::string fresh = b != buffer ? "0" :
+      "getbufvar(" + buf + ", 'changedtick') == " + to_string(tick) +
+      " && " + lo + " >= " + to_string(first + 1) +
+      " && " + hi + " <= " + to_string(first + lines.size());
+
+  // The length comes from the API; vimscript would have to copy every line.
+  uint64_t lenId = serv.request("buffer_get_length", b);
+  std::string expr =
+      "[getbufvar(" + buf + ", 'changedtick'), "
+      "(" + fresh + ") ? 0 : getbufline(" + buf + ", " + lo + ", " + hi + ")]";
+  uint64_t evalId = serv.request("vim_eval", expr);
+
+  serv.grab(lenId, length);
+  msgpack::object o = serv.grab(evalId);
+  if (o.type != msgpack::type::ARRAY || o.via.array.size != 2)
+    return false;
+
+  buffer = b;
+  tick   = o.via.array.ptr[0].as<uint64_t>();
+  return take_lines(o.via.array.ptr[1]);
+}
+
+bool BufferMirror::take_lines(const msgpack::object &o)
+{
+  if (o.type != msgpack::type::ARRAY)
+    return false;
+
+  o.convert(&lines);
+  first = cursor.first > (int) above ? cursor.first - above - 1 : 0;
+  return true;
+}
+
+const std::string *BufferMirror::line(size_t i) const
+{
+  if (i < first || i - first >= lines.size())
+    return nullptr;
+  return &lines[i - first];
+}
+
+void BufferMirror::track_speed()
+{
+  Clock::time_point now = Clock::now();
+  double dt = std::chrono::duration<double>(now - lastUpdate).count();
+  double v  = (cursor.first - lastLine) / std::max(dt, 1e-3);
+
+  // Forget about old motion quickly; a pause means we've stopped.
+  speed = dt > 1 ? 0 : (speed + v) / 2;
+  lastLine   = cursor.first;
+  lastUpdate = now;
+}
+
+void BufferMirror::collect_prefetch()
+{
+  msgpack::object o;
+  if (!prefetch.id || !serv.grab_if_ready(prefetch.id, o))
+    return;
+  prefetch.id = 0;
+
+  // If the buffer changed since we asked, the next update() refetches anyway.
+  if (prefetch.buffer != buffer || prefetch.tick != tick
+      || o.type != msgpack::type::ARRAY)
+    return;
+
+  Lines chunk = o.convert();
+  size_t end = first + lines.size();
+  if (prefetch.start == end) {
+    lines.insert(std::end(lines), std::begin(chunk), std::end(chunk));
+    if (lines.size() > capacity) {
+      size_t drop = lines.size() - capacity;
+      lines.erase(std::begin(lines), std::begin(lines) + drop);
+      first += drop;
+    }
+  } else if (prefetch.end == first) {
+    lines.insert(std::begin(lines), std::begin(chunk), std::end(chunk));
+    first = prefetch.start;
+    if (lines.size() > capacity)
+      lines.resize(capacity);
+  }
+}
+
+void BufferMirror::start_prefetch()
+{
+  if (prefetch.id || lines.empty())
+    return;
+
+  // Have what we'd scroll through in the next `lead` seconds, and at least
+  // another screenful, ready; ask for twice that when we run short.
+  size_t ahead = std::max(below, (size_t) (std::abs(speed) * lead));
+  size_t chunk = std::min(2 * ahead, capacity / 4);
+
+  size_t line = cursor.first - 1;
+  size_t end  = first + lines.size();
+
+  if (line < first || line >= end)
+    return;
+
+  size_t start, stop;
+  if (speed >= 0 && end < length && end - line < ahead) {
+    start = end;
+    stop  = std::min(length, end + chunk);
+  } else if (speed < 0 && first > 0 && line - first < ahead) {
+    start = first > chunk ? first - chunk : 0;
+    stop  = first;
+  } else {
+    return;
+  }
+
+  prefetch.id = serv.request("buffer_get_slice", buffer, start, stop,
+                             true, false);
+  prefetch.buffer = buffer;
+  prefetch.tick   = tick;
+  prefetch.start  = start;
+  prefetch.end    = stop;
+}
+
+void BufferMirror::invalidate()
+{
+  tick = 0;
+  lines.clear();
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "NeoServer.h"
+
+/// A local copy of the lines around the cursor of the current buffer.
+///
+/// update() costs exactly one round trip: a single vim_eval reports the
+/// current buffer, its b:changedtick and the cursor, and only carries the
+/// surrounding lines when the ones we hold are stale. Keypresses that merely
+/// move the cursor within the mirrored range never transfer buffer text.
+///
+/// While the cursor moves, update() also keeps a get_slice in flight for the
+/// lines it is heading towards, sized by how fast it is going, so scrolling
+/// is served from memory while the next chunk loads.
+struct BufferMirror
+{
+  using Lines = std::vector<std::string>;
+  using Pos   = std::pair<int,int>;
+
+  NeoServer &serv;
+  size_t above;         ///< Lines to keep above the cursor.
+  size_t below;         ///< Lines to keep below the cursor.
+
+  uint64_t buffer = 0;  ///< Buffer number (the same as its API handle).
+  uint64_t tick   = 0;  ///< b:changedtick at the time `lines` were fetched.
+  size_t   length = 0;  ///< The number of lines in the whole buffer.
+  Pos      cursor;      ///< 1-based line, 0-based byte column.
+  int      winnr  = 0;  ///< winnr() of the window, if it was current.
+  std::string mode;     ///< mode(), if it was current.
+
+  /// The search pattern being typed on the command line (empty when there's
+  /// none), and the options that decide its case, if the window was current.
+  std::string search;
+  bool ignorecase = false, smartcase = false;
+
+  /// How long update() takes, smoothed.
+  std::chrono::duration<double> rtt{0};
+
+  size_t first = 0;     ///< The (0-based) index of lines[0] in the buffer.
+  Lines  lines;
+
+  /// The most lines to hold. Prefetching past it drops lines from the end
+  /// the cursor is moving away from.
+  size_t capacity = 1 << 14;
+
+  /// How far ahead, in seconds of scrolling at the current speed, to fetch.
+  double lead = 0.5;
+
+  BufferMirror(NeoServer&, size_t above, size_t below);
+
+  /// Discards the prefetch in flight, if any.
+  ~BufferMirror();
+
+  /// Synchronizes with nvim's current window.
+  /// @returns true if `lines` were refetched.
+  bool update();
+
+  /// Synchronizes with a window that may not be the current one. This takes
+  /// two round trips, since vimscript can't see other windows' cursors.
+  bool update(uint64_t window);
+
+  /// Gets line `i` (0-based), or nullptr if it isn't mirrored.
+  const std::string *line(size_t i) const;
+
+  /// Forgets the mirrored lines so the next update() refetches them.
+  void invalidate();
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  /// The cursor's speed in lines per second (negative going up), smoothed.
+  double speed = 0;
+  int lastLine = 0;
+  Clock::time_point lastUpdate;
+
+  /// The get_slice in flight, if `id` isn't zero.
+  struct Prefetch
+  {
+    uint64_t id = 0;
+    uint64_t buffer, tick;
+    size_t start, end;
+  } prefetch;
+
+  /// Takes the lines from an update, unless nvim said ours are still fresh.
+  bool take_lines(const msgpack::object &);
+
+  void track_speed();
+  void collect_prefetch();
+  void start_prefetch();
+};
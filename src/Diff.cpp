@@ -0,0 +1,137 @@
+#include "Diff.h"
+
+#include <algorithm>
+#include <functional>
+
+using Lines = std::vector<std::string>;
+
+std::vector<Hunk> diff_lines(const Lines &a, const Lines &b, size_t maxEdits)
+{
+  size_t pre = 0;
+  while (pre < a.size() && pre < b.size() && a[pre] == b[pre])
+    pre++;
+
+  size_t suf = 0;
+  while (suf < a.size() - pre && suf < b.size() - pre
+         && a[a.size() - 1 - suf] == b[b.size() - 1 - suf])
+    suf++;
+
+  int n = a.size() - pre - suf;
+  int m = b.size() - pre - suf;
+  if (n == 0 && m == 0)
+    return {};
+
+  Hunk all{pre, pre + n, pre, pre + m};
+  if (n == 0 || m == 0)
+    return {all};
+
+  std::hash<std::string> hash;
+  std::vector<size_t> ha(n), hb(m);
+  for (int i = 0; i < n; i++)
+    ha[i] = hash(a[pre + i]);
+  for (int j = 0; j < m; j++)
+    hb[j] = hash(b[pre + j]);
+
+  auto same = [&](int x, int y) {
+    return ha[x] == hb[y] && a[pre + x] == b[pre + y];
+  };
+
+  // v[off + k] is the furthest x reached on diagonal k = x - y. Before each
+  // round d, the part of v it can read is saved so the path can be traced
+  // back afterwards.
+  int max = std::min<size_t>(n + m, maxEdits);
+  int off = max + 1;
+  std::vector<int> v(2 * max + 3, 0);
+  std::vector<std::vector<int>> trace;
+
+  int d = 0;
+  for (bool found = false; !found; d++) {
+    if (d > max)
+      return {all};
+
+    trace.emplace_back(std::begin(v) + off - d - 1, std::begin(v) + off + d + 2);
+
+    for (int k = -d; k <= d && !found; k += 2) {
+      int x = (k == -d || (k != d && v[off + k - 1] < v[off + k + 1]))
+              ? v[off + k + 1] : v[off + k - 1] + 1;
+      int y = x - k;
+      while (x < n && y < m && same(x, y))
+        x++, y++;
+      v[off + k] = x;
+      found = x >= n && y >= m;
+    }
+  }
+
+  // Walk back from the end, marking what was deleted from `a` and inserted
+  // from `b`.
+  std::vector<bool> deleted(n), inserted(m);
+  int x = n, y = m;
+  for (d--; d > 0; d--) {
+    const std::vector<int> &w = trace[d];
+    auto at = [&](int k) { return w[k + d + 1]; };
+
+    int k = x - y;
+    int pk = (k == -d || (k != d && at(k - 1) < at(k + 1))) ? k + 1 : k - 1;
+    int px = at(pk);
+    int py = px - pk;
+
+    // Skip the snake back to where this round's edit ended.
+    while (x > px && y > py)
+      x--, y--;
+
+    if (x == px)
+      inserted[py] = true;
+    else
+      deleted[px] = true;
+    x = px;
+    y = py;
+  }
+
+  // The unmarked lines of each side pair up in order; hunks are the runs
+  // between them.
+  std::vector<Hunk> hunks;
+  int i = 0, j = 0;
+  while (i < n || j < m) {
+    if (i < n && j < m && !deleted[i] && !inserted[j]) {
+      i++, j++;
+      continue;
+    }
+
+    Hunk h{pre + i, 0, pre + j, 0};
+    while ((i < n && deleted[i]) || (j < m && inserted[j])) {
+      if (i < n && deleted[i])
+        i++;
+      else
+        j++;
+    }
+    h.aEnd = pre + i;
+    h.bEnd = pre + j;
+    hunks.push_back(h);
+  }
+
+  return hunks;
+}
+
+std::vector<Hunk> split_slice(size_t start, size_t end, const Lines &lines,
+                              size_t chunkBytes)
+{
+  std::vector<Hunk> pieces;
+  size_t from = 0;
+  do {
+    size_t to = from, bytes = 0;
+    while (to < lines.size() && (to == from || bytes < chunkBytes))
+      bytes += lines[to++].size();
+
+    if (from == 0) {
+      pieces.push_back({start, end, 0, to});
+    } else {
+      // The line above is the last of the piece before, so rewriting it
+      // changes nothing, wherever the buffer ends.
+      size_t at = start + from;
+      pieces.push_back({at - 1, at, from - 1, to});
+    }
+    from = to;
+  } while (from < lines.size());
+
+  return pieces;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/// One edit: lines [aStart, aEnd) of the old text become [bStart, bEnd) of
+/// the new. Either range may be empty.
+struct Hunk
+{
+  size_t aStart, aEnd;
+  size_t bStart, bEnd;
+};
+
+/// The shortest list of hunks that turns `a` into `b`, in order.
+///
+/// Uses Myers' O(ND) algorithm, where D is the number of lines added or
+/// removed, after trimming the common prefix and suffix. Lines are hashed
+/// first so most comparisons are of integers. Past `maxEdits` the search
+/// gives up and returns one hunk covering everything that differs, since a
+/// diff that big saves little over sending it all.
+std::vector<Hunk> diff_lines(const std::vector<std::string> &a,
+                             const std::vector<std::string> &b,
+                             size_t maxEdits=2048);
+
+/// The pieces that replace lines [start, end) of a buffer with `lines`, as
+/// buffer_set_slice calls of about `chunkBytes` each: the first replaces
+/// [start, end), and each after it goes below the one before.
+///
+/// nvim can't insert after the last line, so no piece inserts; each after
+/// the first replaces the line above it with that same line and its own.
+std::vector<Hunk> split_slice(size_t start, size_t end,
+                              const std::vector<std::string> &lines,
+                              size_t chunkBytes);
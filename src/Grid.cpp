@@ -0,0 +1,216 @@
+#include "Grid.h"
+#include "LineMeasure.h"
+
+#include <algorithm>
+#include <wchar.h>  // wcwidth()
+
+uint16_t Palette::id(const Attr &a)
+{
+  auto it = std::find(std::begin(attrs), std::end(attrs), a);
+  if (it != std::end(attrs))
+    return it - std::begin(attrs);
+
+  attrs.push_back(a);
+  return attrs.size() - 1;
+}
+
+Grid::Grid(int rows, int cols)
+{
+  resize(rows, cols);
+}
+
+void Grid::resize(int rows, int cols)
+{
+  this->rows = rows;
+  this->cols = cols;
+  words = (cols + 63) / 64;
+
+  chars.assign((size_t) rows * cols, ' ');
+  attrs.assign((size_t) rows * cols, 0);
+  dirty.assign((size_t) rows * words, 0);
+  mark_all();
+}
+
+void Grid::set(int row, int col, char32_t c, uint16_t attr)
+{
+  size_t i = index(row, col);
+  if (chars[i] == c && attrs[i] == attr)
+    return;
+  chars[i] = c;
+  attrs[i] = attr;
+  mark(row, col);
+}
+
+int Grid::put(int row, int col, const std::string &utf8, uint16_t attr)
+{
+  if (row < 0 || row >= rows || col < 0)
+    return col;
+
+  // Writing over the second half of a wide character breaks it.
+  if (col > 0 && col < cols && at(row, col) == 0)
+    set(row, col - 1, ' ', attrs[index(row, col - 1)]);
+
+  const char *p   = utf8.data();
+  const char *end = p + utf8.size();
+  while (p != end && col < cols) {
+    char32_t c = (unsigned char) *p;
+    size_t len = 1;
+    int width  = 1;
+
+    if (c >= 0x80) {
+      len = decode_utf8(p, end, c);
+      width = len ? wcwidth((wchar_t) c) : -1;
+      if (width < 0) {
+        c = '?';
+        len = std::max(len, (size_t) 1);
+        width = 1;
+      }
+    }
+    p += len;
+
+    // Cells only hold one codepoint, so combining characters are dropped.
+    if (width == 0)
+      continue;
+    if (col + width > cols)
+      break;
+
+    set(row, col, c, attr);
+    if (width == 2)
+      set(row, col + 1, 0, attr);
+    col += width;
+  }
+
+  // ...and so does writing over the first half.
+  if (col < cols && at(row, col) == 0)
+    set(row, col, ' ', attrs[index(row, col)]);
+
+  return col;
+}
+
+void Grid::fill(int row, int col, int n, char32_t c, uint16_t attr)
+{
+  n = std::min(n, cols - col);
+  for (int i = 0; i < n; i++)
+    set(row, col + i, c, attr);
+}
+
+void Grid::paint(int row, int col, int n, uint16_t attr)
+{
+  n = std::min(n, cols - col);
+  size_t i = index(row, col);
+  for (int j = 0; j < n; j++) {
+    if (attrs[i + j] != attr) {
+      attrs[i + j] = attr;
+      mark(row, col + j);
+    }
+  }
+}
+
+void Grid::blit(const Grid &src, int sy, int sx, int h, int w, int dy, int dx)
+{
+  h = std::min({h, src.rows - sy, rows - dy});
+  w = std::min({w, src.cols - sx, cols - dx});
+
+  for (int y = 0; y < h; y++) {
+    const char32_t *sc = &src.chars[src.index(sy + y, sx)];
+    const uint16_t *sa = &src.attrs[src.index(sy + y, sx)];
+    char32_t *dc = &chars[index(dy + y, dx)];
+    uint16_t *da = &attrs[index(dy + y, dx)];
+
+    // Rows that didn't change cost a compare and nothing else.
+    if (std::equal(sc, sc + w, dc) && std::equal(sa, sa + w, da))
+      continue;
+
+    for (int x = 0; x < w; x++) {
+      if (dc[x] != sc[x] || da[x] != sa[x]) {
+        dc[x] = sc[x];
+        da[x] = sa[x];
+        mark(dy + y, dx + x);
+      }
+    }
+  }
+}
+
+void Grid::scroll_region(int top, int bottom, int n)
+{
+  if (n == 0 || top >= bottom)
+    return;
+
+  int height = bottom - top;
+  for (int k = 0; k < height; k++) {
+    // Copy towards the direction we scroll, so sources are read first.
+    int y = n > 0 ? top + k : bottom - 1 - k;
+    int from = y + n;
+
+    if (from >= top && from < bottom) {
+      std::copy_n(&chars[index(from, 0)], cols, &chars[index(y, 0)]);
+      std::copy_n(&attrs[index(from, 0)], cols, &attrs[index(y, 0)]);
+    } else {
+      std::fill_n(&chars[index(y, 0)], cols, ' ');
+      std::fill_n(&attrs[index(y, 0)], cols, 0);
+    }
+    std::fill_n(&dirty[(size_t) y * words], words, ~(uint64_t) 0);
+  }
+}
+
+bool Grid::diff_row(const Grid &other, int row)
+{
+  int n = std::min(cols, other.cols);
+  const char32_t *a = &chars[index(row, 0)];
+  const char32_t *b = &other.chars[other.index(row, 0)];
+  const uint16_t *aa = &attrs[index(row, 0)];
+  const uint16_t *ba = &other.attrs[other.index(row, 0)];
+
+  bool any = false;
+  for (int x = 0; x < n; x++) {
+    if (a[x] != b[x] || aa[x] != ba[x]) {
+      mark(row, x);
+      any = true;
+    }
+  }
+  return any;
+}
+
+bool Grid::row_dirty(int row) const
+{
+  const uint64_t *d = &dirty[(size_t) row * words];
+  return std::any_of(d, d + words, [](uint64_t w) { return w != 0; });
+}
+
+std::vector<Grid::Span> Grid::dirty_spans(int row, int gap) const
+{
+  std::vector<Span> spans;
+  const uint64_t *d = &dirty[(size_t) row * words];
+
+  for (int w = 0; w < words; w++) {
+    uint64_t bits = d[w];
+    while (bits) {
+      int x = w * 64 + __builtin_ctzll(bits);
+      bits &= bits - 1;
+      if (x >= cols)
+        break;
+
+      if (!spans.empty() && x - spans.back().second < gap)
+        spans.back().second = x + 1;
+      else
+        spans.emplace_back(x, x + 1);
+    }
+  }
+
+  return spans;
+}
+
+void Grid::mark(int row, int col)
+{
+  dirty[(size_t) row * words + col / 64] |= (uint64_t) 1 << (col % 64);
+}
+
+void Grid::mark_all()
+{
+  std::fill(std::begin(dirty), std::end(dirty), ~(uint64_t) 0);
+}
+
+void Grid::clean()
+{
+  std::fill(std::begin(dirty), std::end(dirty), 0);
+}
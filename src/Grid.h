@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// How a cell looks: curses attribute bits (A_BOLD, ...) and a color pair.
+struct Attr
+{
+  uint32_t flags = 0;
+  short pair = 0;
+
+  bool operator== (const Attr &o) const
+  {
+    return flags == o.flags && pair == o.pair;
+  }
+};
+
+/// Gives every distinct Attr a small id, so each cell only stores 16 bits.
+/// Id 0 is always the default attribute.
+struct Palette
+{
+  std::vector<Attr> attrs{Attr()};
+
+  uint16_t id(const Attr &);
+  const Attr &operator[] (uint16_t id) const { return attrs[id]; }
+};
+
+/// A rectangle of character cells, such as the contents of a TermWindow.
+///
+/// Cells are stored as parallel arrays (codepoints and attribute ids), so
+/// comparing or copying a row touches only the memory it needs. Every write
+/// that actually changes a cell sets its bit in a per-row dirty bitset, so a
+/// renderer can send just the changed spans to the terminal.
+///
+/// A wide character takes two cells: its codepoint and a zero.
+struct Grid
+{
+  using Span = std::pair<int,int>;  ///< Columns [first, second).
+
+  int rows = 0, cols = 0;
+
+  std::vector<char32_t> chars;
+  std::vector<uint16_t> attrs;
+
+  Grid(int rows=0, int cols=0);
+
+  /// Resizes and blanks the grid, marking everything dirty.
+  void resize(int rows, int cols);
+
+  char32_t at(int row, int col) const { return chars[index(row, col)]; }
+  uint16_t attr(int row, int col) const { return attrs[index(row, col)]; }
+
+  /// Sets one cell.
+  void set(int row, int col, char32_t, uint16_t attr=0);
+
+  /// Writes UTF-8 text starting at (row, col), clipped to the row.
+  /// @returns the column after the last cell written.
+  int put(int row, int col, const std::string &utf8, uint16_t attr=0);
+
+  /// Sets `n` cells to `c`.
+  void fill(int row, int col, int n, char32_t c=' ', uint16_t attr=0);
+
+  /// Changes the attribute of `n` cells, leaving the text alone.
+  void paint(int row, int col, int n, uint16_t attr);
+
+  /// Copies an h*w block from `src` at (sy, sx) to (dy, dx) in this grid.
+  void blit(const Grid &src, int sy, int sx, int h, int w, int dy, int dx);
+
+  /// Moves the rows in [top, bottom) up by n (down if n is negative), like
+  /// a terminal's scroll region, blanking the rows left behind.
+  void scroll_region(int top, int bottom, int n);
+
+  /// Marks the cells of `row` that differ from the same row of `other`.
+  /// @returns true if any did.
+  bool diff_row(const Grid &other, int row);
+
+  bool row_dirty(int row) const;
+
+  /// The dirty parts of a row. Spans less than `gap` cells apart are joined,
+  /// since moving the cursor costs about as much as rewriting a few cells.
+  std::vector<Span> dirty_spans(int row, int gap=4) const;
+
+  void mark(int row, int col);
+  void mark_all();
+  void clean();
+
+private:
+  int words = 0;                ///< 64-bit words of dirty bits per row.
+  std::vector<uint64_t> dirty;
+
+  size_t index(int row, int col) const { return (size_t) row * cols + col; }
+};
@@ -0,0 +1,93 @@
+#include "Layout.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+Layout Layout::parse(const msgpack::object &o)
+{
+  // Notification arguments may come wrapped in an array.
+  if (o.type == msgpack::type::ARRAY && o.via.array.size == 1)
+    return parse(o.via.array.ptr[0]);
+
+  Layout l;
+  if (o.type != msgpack::type::MAP)
+    return l;
+
+  std::map<std::string, msgpack::object> node = o.convert();
+
+  std::string type;
+  node["type"].convert(&type);
+
+  if (type == "leaf") {
+    l.type = LEAF;
+    node["window_id"].convert(&l.window);
+    node["height"]   .convert(&l.height);
+    node["width"]    .convert(&l.width);
+  } else {
+    l.type = type == "row" ? ROW : COLUMN;
+
+    std::vector<msgpack::object> children = node["children"].convert();
+    for (const msgpack::object &child : children)
+      l.children.push_back(parse(child));
+  }
+
+  return l;
+}
+
+void Layout::place(int y, int x, int status)
+{
+  this->y = y;
+  this->x = x;
+
+  switch (type) {
+   case LEAF:
+    ext_y = height + status;
+    ext_x = width;
+   break;
+
+   case ROW:
+    ext_y = ext_x = 0;
+    for (Layout &child : children) {
+      if (ext_x)
+        ext_x++;  // the vertical separator
+      child.place(y, x + ext_x, status);
+      ext_x += child.ext_x;
+      ext_y  = std::max(ext_y, child.ext_y);
+    }
+   break;
+
+   case COLUMN:
+    ext_y = ext_x = 0;
+    for (Layout &child : children) {
+      child.place(y + ext_y, x, status);
+      ext_y += child.ext_y;
+      ext_x  = std::max(ext_x, child.ext_x);
+    }
+   break;
+  }
+
+  if (type != LEAF) {
+    height = ext_y;
+    width  = ext_x;
+  }
+}
+
+void Layout::leaves(std::vector<const Layout *> &out) const
+{
+  if (type == LEAF)
+    out.push_back(this);
+  for (const Layout &child : children)
+    child.leaves(out);
+}
+
+size_t Layout::count_leaves() const
+{
+  if (type == LEAF)
+    return 1;
+
+  size_t n = 0;
+  for (const Layout &child : children)
+    n += child.count_leaves();
+  return n;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+
+#include <msgpack.hpp>
+
+/// A node of nvim's window layout, as sent in redraw:layout notifications.
+///
+/// Leaves are windows; rows place their children side by side and columns
+/// stack them. After place(), every node knows where it is on screen.
+struct Layout
+{
+  enum Type { LEAF, ROW, COLUMN };
+
+  Type type = LEAF;
+  uint64_t window = 0;  ///< The window's handle, for leaves.
+
+  int height = 0;       ///< For leaves, of the text area only.
+  int width  = 0;
+  int y = 0, x = 0;     ///< Set by place().
+
+  std::vector<Layout> children;
+
+  /// Parses the argument of a redraw:layout notification.
+  static Layout parse(const msgpack::object &);
+
+  /// Positions this node at (y, x) and everything below it after it.
+  /// Each window is followed by `status` rows for its status line, and
+  /// side-by-side windows are divided by a one column separator.
+  void place(int y, int x, int status);
+
+  /// The rows and columns this node covers on screen, after place().
+  int extent_y() const { return ext_y; }
+  int extent_x() const { return ext_x; }
+
+  /// Appends the leaves from top-left to bottom-right; the same order vim
+  /// numbers its windows in, so leaves[winnr() - 1] is the current window.
+  void leaves(std::vector<const Layout *> &) const;
+
+  size_t count_leaves() const;
+
+private:
+  int ext_y = 0, ext_x = 0;
+};
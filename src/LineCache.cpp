@@ -0,0 +1,223 @@
+#include "LineCache.h"
+
+#include <algorithm>
+#include <memory>
+
+LineCache::LineCache(NeoServer &serv, uint64_t buffer,
+                     size_t budget, size_t pageLines)
+  : serv(serv), buffer(buffer), pageLines(pageLines), budget(budget),
+    maxAge(std::chrono::milliseconds(50))
+{
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+LineCache::~LineCache()
+{
+  pthread_mutex_destroy(&lock);
+}
+
+LineCache &LineCache::of(NeoServer &serv, uint64_t buffer)
+{
+  std::shared_ptr<void> c =
+    serv.attachment("LineCache:" + std::to_string(buffer), [&] {
+      return std::make_shared<LineCache>(serv, buffer);
+    });
+  return *static_cast<LineCache *>(c.get());
+}
+
+const std::string &LineCache::operator[] (size_t i)
+{
+  static const std::string none;
+
+  ScopedLock l(lock);
+  validate_if_old();
+
+  size_t index = i / pageLines;
+  Page *p = find(index);
+  if (p) {
+    hits++;
+  } else {
+    fetch(index, index + 1);
+    p = find(index);
+  }
+  evict();
+
+  // Eviction never touches the page we just used, since it's the newest.
+  if (!p || i % pageLines >= p->lines.size())
+    return none;
+  return p->lines[i % pageLines];
+}
+
+LineCache::Lines LineCache::slice(size_t start, size_t end)
+{
+  ScopedLock l(lock);
+  validate_if_old();
+  end = std::min(end, len);
+
+  Lines ret;
+  if (start >= end)
+    return ret;
+  ret.reserve(end - start);
+
+  // Fetch a few pages at a time, so a huge slice doesn't hold the whole
+  // range in the cache on top of the copy we return.
+  const size_t batch = 16;
+  size_t lastPage = (end - 1) / pageLines;
+  for (size_t lo = start / pageLines; lo <= lastPage; lo += batch) {
+    size_t hi = std::min(lo + batch, lastPage + 1);
+    fetch(lo, hi);
+
+    for (size_t index = lo; index < hi; index++) {
+      Page *p = find(index);
+      if (!p)
+        continue;
+
+      size_t base = index * pageLines;
+      size_t from = std::max(start, base) - base;
+      size_t to   = std::min(end - base, p->lines.size());
+      if (from < to)
+        ret.insert(std::end(ret), std::begin(p->lines) + from,
+                                  std::begin(p->lines) + to);
+    }
+
+    evict();
+  }
+
+  return ret;
+}
+
+size_t LineCache::length()
+{
+  ScopedLock l(lock);
+  validate_if_old();
+  return len;
+}
+
+bool LineCache::validate()
+{
+  ScopedLock lk(lock);
+
+  // Ask for both at once; they cost one round trip together.
+  uint64_t tickId = serv.request("vim_eval", "getbufvar("
+                                 + std::to_string(buffer) + ", 'changedtick')");
+  uint64_t lenId  = serv.request("buffer_get_length", buffer);
+
+  msgpack::object t = serv.grab(tickId);
+  msgpack::object l = serv.grab(lenId);
+  checked = Clock::now();
+
+  uint64_t newTick = t.type == msgpack::type::POSITIVE_INTEGER ? t.via.u64 : 0;
+  len = l.type == msgpack::type::POSITIVE_INTEGER ? l.via.u64 : 0;
+
+  if (newTick == tick && newTick != 0)
+    return true;
+
+  tick = newTick;
+  lru.clear();
+  pages.clear();
+  bytes = 0;
+  return false;
+}
+
+void LineCache::invalidate()
+{
+  ScopedLock l(lock);
+  lru.clear();
+  pages.clear();
+  bytes = 0;
+  tick = 0;
+  checked = Clock::time_point();
+}
+
+void LineCache::validate_if_old()
+{
+  if (Clock::now() - checked > maxAge)
+    validate();
+}
+
+void LineCache::scan(size_t start, size_t end,
+                     const std::function<void(const std::vector<PageRef> &)> &f,
+                     size_t batch)
+{
+  ScopedLock l(lock);
+  validate_if_old();
+  end = std::min(end, len);
+  if (start >= end)
+    return;
+
+  std::vector<PageRef> refs;
+  size_t lastPage = (end - 1) / pageLines;
+  for (size_t lo = start / pageLines; lo <= lastPage; lo += batch) {
+    size_t hi = std::min(lo + batch, lastPage + 1);
+    fetch(lo, hi);
+
+    refs.clear();
+    for (size_t index = lo; index < hi; index++) {
+      Page *p = find(index);
+      if (p)
+        refs.push_back({index * pageLines, &p->lines});
+    }
+    f(refs);
+
+    // Only now may the batch go, to make room for the next.
+    evict();
+  }
+}
+
+LineCache::Page *LineCache::find(size_t index)
+{
+  auto it = pages.find(index);
+  if (it == std::end(pages))
+    return nullptr;
+
+  lru.splice(std::begin(lru), lru, it->second);
+  return &*it->second;
+}
+
+void LineCache::fetch(size_t lo, size_t hi)
+{
+  // Pipeline the requests, then collect the replies.
+  std::vector<std::pair<size_t, uint64_t>> wanted;
+  for (size_t index = lo; index < hi && index * pageLines < len; index++) {
+    if (pages.count(index)) {
+      hits++;
+      continue;
+    }
+    size_t start = index * pageLines;
+    size_t end   = std::min(start + pageLines, len);
+    wanted.emplace_back(index, serv.request("buffer_get_slice", buffer,
+                                            start, end, true, false));
+  }
+
+  misses += wanted.size();
+  for (auto &w : wanted) {
+    msgpack::object o = serv.grab(w.second);
+    if (o.type == msgpack::type::ARRAY)
+      insert(w.first, o.convert());
+  }
+}
+
+void LineCache::insert(size_t index, Lines lines)
+{
+  size_t size = sizeof(Page);
+  for (const std::string &line : lines)
+    size += sizeof(std::string) + line.size();
+
+  lru.push_front(Page{index, std::move(lines), size});
+  pages[index] = std::begin(lru);
+  bytes += size;
+}
+
+void LineCache::evict()
+{
+  // Always keep the newest page, however big.
+  while (bytes > budget && lru.size() > 1) {
+    bytes -= lru.back().bytes;
+    pages.erase(lru.back().index);
+    lru.pop_back();
+  }
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "NeoServer.h"
+
+/// A paged, least-recently-used cache of one buffer's lines.
+///
+/// Lines are fetched from nvim a page (`pageLines` lines) at a time, so
+/// random access costs one round trip per page instead of one per line, and
+/// a huge buffer never has to come across the socket in one reply. Pages are
+/// evicted, least recently used first, once their text exceeds `budget`
+/// bytes.
+///
+/// The cache is emptied whenever the buffer's b:changedtick moves. Checking
+/// it takes a round trip, so it is done at most once every `maxAge`, or
+/// whenever validate() is called.
+///
+/// Every call takes the cache's lock, so threads may share one; but what
+/// operator[] and scan() hand out is only good until the next call, from any
+/// thread, that may fetch.
+struct LineCache
+{
+  using Lines = std::vector<std::string>;
+  using Clock = std::chrono::steady_clock;
+
+  NeoServer &serv;
+  uint64_t buffer;
+
+  size_t pageLines;           ///< Lines per page.
+  size_t budget;              ///< Bytes of text to hold before evicting.
+  Clock::duration maxAge;     ///< How long to trust a changedtick check.
+
+  size_t hits   = 0;          ///< Page lookups served from memory.
+  size_t misses = 0;          ///< Page lookups that went to nvim.
+
+  LineCache(NeoServer&, uint64_t buffer,
+            size_t budget=64 << 20, size_t pageLines=256);
+  ~LineCache();
+
+  LineCache(const LineCache&) = delete;
+  LineCache &operator= (const LineCache&) = delete;
+
+  /// Gets the cache shared by everything that reads `buffer` through `serv`.
+  /// `serv` owns it, and destroys it along with itself.
+  static LineCache &of(NeoServer &serv, uint64_t buffer);
+
+  /// Gets line `i` (0-based), fetching its page if needed.
+  /// @remark The reference is good until the next call that may fetch.
+  const std::string &operator[] (size_t i);
+
+  /// Gets lines [start, end); missing pages are requested all at once.
+  Lines slice(size_t start, size_t end);
+
+  /// Where a page's lines are, for scan().
+  struct PageRef
+  {
+    size_t first;         ///< The buffer line of lines[0].
+    const Lines *lines;
+  };
+
+  /// Hands `f` the pages covering [start, end), some at a time. Each batch
+  /// stays in memory until `f` returns, so `f` may share it out to other
+  /// threads, but must not call back into the cache meanwhile.
+  void scan(size_t start, size_t end,
+            const std::function<void(const std::vector<PageRef> &)> &f,
+            size_t batch=64);
+
+  /// The number of lines in the buffer.
+  size_t length();
+
+  /// Checks b:changedtick now, and drops every page if it changed.
+  /// @returns true if the cache was still valid.
+  bool validate();
+
+  /// Drops every page; for when we know the buffer changed.
+  void invalidate();
+
+  /// Bytes of text currently held.
+  size_t used() const { return bytes; }
+
+private:
+  struct Page
+  {
+    size_t index;
+    Lines lines;
+    size_t bytes;
+  };
+
+  std::list<Page> lru;  ///< The most recently used page first.
+  std::unordered_map<size_t, std::list<Page>::iterator> pages;
+  size_t bytes = 0;
+
+  uint64_t tick = 0;
+  size_t   len  = 0;
+  Clock::time_point checked;
+
+  /// Recursive, since the public calls use each other.
+  pthread_mutex_t lock;
+
+  void validate_if_old();
+
+  /// Finds a page and marks it as recently used.
+  Page *find(size_t index);
+
+  /// Fetches every page in [lo, hi) that isn't already held.
+  void fetch(size_t lo, size_t hi);
+
+  void insert(size_t index, Lines);
+  void evict();
+};
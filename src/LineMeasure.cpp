@@ -0,0 +1,265 @@
+#include "LineMeasure.h"
+
+#include <algorithm>
+#include <climits>
+#include <wchar.h>  // wcwidth()
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_DISPATCH
+#endif
+
+using Byte = unsigned char;
+
+static bool printable_ascii(Byte c)
+{
+  return c > 0x1f && c < 0x7f;
+}
+
+/// Counts the printable ASCII bytes at the start of [p, end).
+static size_t ascii_run_scalar(const Byte *p, const Byte *end)
+{
+  const Byte *start = p;
+  while (p != end && printable_ascii(*p))
+    p++;
+  return p - start;
+}
+
+#if defined(__SSE2__)
+static size_t ascii_run_sse2(const Byte *p, const Byte *end)
+{
+  const Byte *start = p;
+  const __m128i lo = _mm_set1_epi8(0x1f);
+  const __m128i hi = _mm_set1_epi8(0x7f);
+
+  while (end - p >= 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) p);
+    // Compared as signed chars, bytes >= 0x80 are negative and fail `lo`.
+    __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(x, lo), _mm_cmplt_epi8(x, hi));
+    unsigned mask = _mm_movemask_epi8(ok);
+    if (mask != 0xffff)
+      return (p - start) + __builtin_ctz(~mask);
+    p += 16;
+  }
+
+  return (p - start) + ascii_run_scalar(p, end);
+}
+#endif
+
+#if defined(HAVE_AVX2_DISPATCH)
+__attribute__((target("avx2")))
+static size_t ascii_run_avx2(const Byte *p, const Byte *end)
+{
+  const Byte *start = p;
+  const __m256i lo = _mm256_set1_epi8(0x1f);
+  const __m256i hi = _mm256_set1_epi8(0x7f);
+
+  while (end - p >= 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *) p);
+    __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(x, lo),
+                                  _mm256_cmpgt_epi8(hi, x));
+    unsigned mask = _mm256_movemask_epi8(ok);
+    if (mask != 0xffffffff)
+      return (p - start) + __builtin_ctz(~mask);
+    p += 32;
+  }
+
+  // Leaving the upper halves dirty makes the SSE2 code below stall.
+  _mm256_zeroupper();
+  return (p - start) + ascii_run_sse2(p, end);
+}
+#endif
+
+static size_t decode_utf8(const Byte *p, const Byte *end, char32_t &cp)
+{
+  size_t len;
+  char32_t min;
+
+  if (*p < 0x80) {
+    cp = *p;
+    return 1;
+  } else if ((*p & 0xe0) == 0xc0) {
+    len = 2; cp = *p & 0x1f; min = 0x80;
+  } else if ((*p & 0xf0) == 0xe0) {
+    len = 3; cp = *p & 0x0f; min = 0x800;
+  } else if ((*p & 0xf8) == 0xf0) {
+    len = 4; cp = *p & 0x07; min = 0x10000;
+  } else {
+    return 0;
+  }
+
+  if ((size_t)(end - p) < len)
+    return 0;
+
+  for (size_t i = 1; i < len; i++) {
+    if ((p[i] & 0xc0) != 0x80)
+      return 0;
+    cp = (cp << 6) | (p[i] & 0x3f);
+  }
+
+  // Reject overlong encodings, surrogates and anything past U+10FFFF.
+  if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+    return 0;
+
+  return len;
+}
+
+template<size_t (*AsciiRun)(const Byte *, const Byte *)>
+static MeasuredLine measure(const std::string &line, int width, int tabstop)
+{
+  MeasuredLine m{"", 0, true};
+  m.text.reserve(std::min(line.size(), (size_t) width));
+
+  auto put = [&](const char *s, size_t len, int cols) {
+    m.text.append(s, len);
+    m.cols += cols;
+  };
+
+  const Byte *p   = (const Byte *) line.data();
+  const Byte *end = p + line.size();
+  while (p != end && m.cols < width) {
+    // Most lines are mostly ASCII; take as much of it as we can at once.
+    size_t run = AsciiRun(p, end);
+    if (run) {
+      run = std::min(run, (size_t) (width - m.cols));
+      put((const char *) p, run, run);
+      p += run;
+      continue;
+    }
+
+    if (*p == '\t') {
+      int n = std::min(tabstop - m.cols % tabstop, width - m.cols);
+      m.text.append(n, ' ');
+      m.cols += n;
+      p++;
+      continue;
+    }
+
+    char32_t cp;
+    size_t len = decode_utf8(p, end, cp);
+    if (len == 0) {
+      m.valid = false;
+      put("?", 1, 1);
+      p++;
+      continue;
+    }
+
+    if (cp < 0x20 || cp == 0x7f) {
+      if (m.cols + 2 > width)
+        break;
+      char caret[] = { '^', (char) (cp ^ 0x40) };
+      put(caret, 2, 2);
+      p += len;
+      continue;
+    }
+
+    int w = wcwidth((wchar_t) cp);
+    if (w < 0) {
+      put("?", 1, 1);
+    } else if (m.cols + w > width) {
+      break;  // A wide character does not fit in the last column.
+    } else {
+      put((const char *) p, len, w);
+    }
+    p += len;
+  }
+
+  return m;
+}
+
+using Measure = MeasuredLine (*)(const std::string &, int, int);
+
+static Measure pick_measure()
+{
+#if defined(HAVE_AVX2_DISPATCH)
+  if (__builtin_cpu_supports("avx2"))
+    return measure<ascii_run_avx2>;
+#endif
+#if defined(__SSE2__)
+  return measure<ascii_run_sse2>;
+#else
+  return measure<ascii_run_scalar>;
+#endif
+}
+
+MeasuredLine measure_line(const std::string &line, int width, int tabstop)
+{
+  static const Measure m = pick_measure();
+  return m(line, width, tabstop);
+}
+
+MeasuredLine measure_line_scalar(const std::string &line,
+                                 int width, int tabstop)
+{
+  return measure<ascii_run_scalar>(line, width, tabstop);
+}
+
+size_t decode_utf8(const char *p, const char *end, char32_t &cp)
+{
+  return decode_utf8((const Byte *) p, (const Byte *) end, cp);
+}
+
+void append_utf8(std::string &out, char32_t cp)
+{
+  if (cp < 0x80) {
+    out += (char) cp;
+  } else if (cp < 0x800) {
+    out += (char) (0xc0 | cp >> 6);
+    out += (char) (0x80 | (cp & 0x3f));
+  } else if (cp < 0x10000) {
+    out += (char) (0xe0 | cp >> 12);
+    out += (char) (0x80 | (cp >> 6 & 0x3f));
+    out += (char) (0x80 | (cp & 0x3f));
+  } else {
+    out += (char) (0xf0 | cp >> 18);
+    out += (char) (0x80 | (cp >> 12 & 0x3f));
+    out += (char) (0x80 | (cp >> 6 & 0x3f));
+    out += (char) (0x80 | (cp & 0x3f));
+  }
+}
+
+int display_column(const std::string &line, size_t len, int tabstop)
+{
+  return measure_line(line.substr(0, len), INT_MAX, tabstop).cols;
+}
+
+int display_column_scalar(const std::string &line, size_t len, int tabstop)
+{
+  return measure_line_scalar(line.substr(0, len), INT_MAX, tabstop).cols;
+}
+
+std::vector<int> column_map(const std::string &line, int width, int tabstop)
+{
+  std::vector<int> cols;
+  cols.reserve(std::min(line.size(), (size_t) width) + 1);
+
+  // Widths as measure() gives them, but with nothing clipped.
+  const Byte *p   = (const Byte *) line.data();
+  const Byte *end = p + line.size();
+  int col = 0;
+  while (p != end && col < width) {
+    size_t len = 1;
+    int w = 1;
+    char32_t cp;
+    if (printable_ascii(*p))
+      ;
+    else if (*p == '\t')
+      w = tabstop - col % tabstop;
+    else if ((len = decode_utf8(p, end, cp)) == 0)
+      len = 1;  // Shown as '?'.
+    else if (cp < 0x20 || cp == 0x7f)
+      w = 2;
+    else if ((w = wcwidth((wchar_t) cp)) < 0)
+      w = 1;  // Shown as '?'.
+
+    cols.insert(std::end(cols), len, col);
+    col += w;
+    p += len;
+  }
+  cols.push_back(col);
+  return cols;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/// A buffer line, fitted to the width of a terminal row.
+struct MeasuredLine
+{
+  std::string text;  ///< What to print: tabs expanded, clipped to the width.
+  int cols;          ///< The number of display columns `text` occupies.
+  bool valid;        ///< False if the line was not well-formed UTF-8.
+};
+
+/// Validates `line` as UTF-8, computes the display width of each character,
+/// expands tabs and clips to `width` columns, all in one pass.
+///
+/// Runs of printable ASCII are measured 16 (SSE2) or 32 (AVX2) bytes at a
+/// time. Malformed sequences are shown as '?' and control characters as ^X,
+/// like vim does.
+///
+/// @remark Wide characters depend on wcwidth(), so call setlocale() first.
+MeasuredLine measure_line(const std::string &line, int width, int tabstop=8);
+
+/// The same as measure_line(), but without the vectorized fast path.
+MeasuredLine measure_line_scalar(const std::string &line,
+                                 int width, int tabstop=8);
+
+/// Counts the display columns of the first `len` bytes of `line`.
+/// Useful for converting a byte-offset cursor into a screen column.
+int display_column(const std::string &line, size_t len, int tabstop=8);
+
+/// The same as display_column(), but without the vectorized fast path.
+int display_column_scalar(const std::string &line, size_t len, int tabstop=8);
+
+/// The display column of every byte offset in `line`, up to and including
+/// line.size(), in one pass; a byte inside a character gets the column the
+/// character starts at. Stops at the first offset `width` columns or more
+/// in, so offsets past the end of the result are at least that far.
+std::vector<int> column_map(const std::string &line, int width,
+                            int tabstop=8);
+
+/// Decodes one UTF-8 sequence from [p, end) into `cp`.
+/// @returns its length in bytes, or zero if it is malformed.
+size_t decode_utf8(const char *p, const char *end, char32_t &cp);
+
+/// Appends `cp` to `out`, encoded as UTF-8.
+void append_utf8(std::string &out, char32_t cp);
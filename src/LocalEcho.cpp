@@ -0,0 +1,173 @@
+#include "LocalEcho.h"
+
+#include <algorithm>
+#include <cctype>
+#include <curses.h>
+
+/// Steps back from byte `col` to the start of the previous UTF-8 character.
+static size_t prev_char(const std::string &s, size_t col)
+{
+  if (col == 0)
+    return 0;
+  do
+    col--;
+  while (col > 0 && (s[col] & 0xc0) == 0x80);
+  return col;
+}
+
+/// Steps forward from byte `col` to the start of the next UTF-8 character.
+static size_t next_char(const std::string &s, size_t col)
+{
+  if (col >= s.size())
+    return s.size();
+  do
+    col++;
+  while (col < s.size() && (s[col] & 0xc0) == 0x80);
+  return col;
+}
+
+bool LocalEcho::key(int k, const BufferMirror &m)
+{
+  if (frozen)
+    return false;
+
+  if (!predicting) {
+    cursor = m.cursor;
+    since  = Clock::now();
+  }
+
+  size_t row = cursor.first - 1;
+  size_t col = cursor.second;
+  const std::string *cur = line(row, m);
+  if (!cur)
+    return freeze();
+  std::string text = *cur;
+
+  bool insert = m.mode == "i";
+  bool normal = m.mode == "n";
+
+  // Normal mode's cursor sits on a character; insert mode's, between two.
+  auto last = [&](const std::string &s) {
+    return insert ? s.size() : prev_char(s, s.size());
+  };
+
+  auto vertical = [&](int dir) {
+    size_t to = row + dir;
+    if ((dir < 0 && row == 0) || to >= m.length || !line(to, m))
+      return false;
+    row = to;
+    col = std::min(col, last(*line(row, m)));
+    return true;
+  };
+
+  if (insert && k <= 0xff && (std::isprint(k) || k >= 0x80)) {
+    text.insert(col++, 1, (char) k);
+  } else if (insert && (k == KEY_BACKSPACE || k == 0x7f || k == '\b')) {
+    if (col == 0)
+      return freeze();  // That would join lines.
+    size_t from = prev_char(text, col);
+    text.erase(from, col - from);
+    col = from;
+  } else if (!insert && !normal) {
+    return freeze();
+  } else if (k == KEY_LEFT || (normal && k == 'h')) {
+    if (insert && col == 0)
+      return freeze();  // Might wrap, depending on 'whichwrap'.
+    col = prev_char(text, col);
+  } else if (k == KEY_RIGHT || (normal && k == 'l')) {
+    if (insert && col >= text.size())
+      return freeze();
+    col = std::min(next_char(text, col), last(text));
+  } else if (k == KEY_UP || (normal && k == 'k')) {
+    if (!vertical(-1))
+      return freeze();
+  } else if (k == KEY_DOWN || (normal && k == 'j')) {
+    if (!vertical(+1))
+      return freeze();
+  } else {
+    return freeze();
+  }
+
+  if (text != *cur)
+    lines[cursor.first - 1] = std::move(text);
+  cursor = { (int) row + 1, (int) col };
+  predicting = true;
+  return true;
+}
+
+void LocalEcho::heard_from_nvim()
+{
+  heard = true;
+}
+
+void LocalEcho::reconcile(const BufferMirror &m)
+{
+  // Drop the lines nvim agrees with.
+  bool confirmed = false;
+  for (auto it = std::begin(lines); it != std::end(lines); ) {
+    const std::string *real = m.line(it->first);
+    if (real && *real == it->second) {
+      it = lines.erase(it);
+      confirmed = true;
+    } else {
+      it++;
+    }
+  }
+
+  Clock::time_point now = Clock::now();
+  auto limit = std::max(timeout, std::chrono::duration_cast<Clock::duration>(
+                                     4 * m.rtt));
+
+  if (lines.empty() && m.cursor == cursor) {
+    predicting = false;
+  } else if (confirmed) {
+    since = now;  // nvim is catching up; give it time to finish.
+  } else if (predicting && now - since > limit) {
+    lines.clear();  // Mispredicted; show what nvim says.
+    predicting = false;
+  }
+
+  if (!predicting)
+    lines.clear();
+
+  // Once nvim has processed whatever we couldn't predict, we can go on. Not
+  // every key makes it say so, so give up waiting after a while.
+  if (frozen && !predicting && (heard || now - frozenAt > limit))
+    frozen = false;
+}
+
+const std::string *LocalEcho::line(size_t i, const BufferMirror &m) const
+{
+  auto it = lines.find(i);
+  return it != std::end(lines) ? &it->second : m.line(i);
+}
+
+std::pair<size_t,size_t> LocalEcho::unconfirmed(size_t i,
+                                                const BufferMirror &m) const
+{
+  auto it = lines.find(i);
+  const std::string *real = m.line(i);
+  if (it == std::end(lines) || !real)
+    return {0, 0};
+
+  // Whatever lies between the common prefix and the common suffix.
+  const std::string &guess = it->second;
+  size_t pre = 0;
+  while (pre < guess.size() && pre < real->size() && guess[pre] == (*real)[pre])
+    pre++;
+
+  size_t suf = 0;
+  while (suf < guess.size() - pre && suf < real->size() - pre
+         && guess[guess.size() - 1 - suf] == (*real)[real->size() - 1 - suf])
+    suf++;
+
+  return {pre, guess.size() - suf};
+}
+
+bool LocalEcho::freeze()
+{
+  frozen   = true;
+  heard    = false;
+  frozenAt = Clock::now();
+  return false;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "BufferMirror.h"
+
+/// Speculative local echo, in the spirit of mosh.
+///
+/// When a key is sent to nvim, key() guesses what it will do (insert a
+/// character, delete one, move the cursor) and records the result as an
+/// overlay on the mirrored lines, so it can be drawn before nvim replies.
+/// Only insert-mode typing and simple motions are predicted; any other key
+/// freezes prediction until nvim has caught up.
+///
+/// reconcile() compares the overlay with each authoritative update: lines
+/// nvim agrees with are dropped, and predictions that stay unconfirmed for
+/// too long are rolled back.
+struct LocalEcho
+{
+  using Clock = std::chrono::steady_clock;
+  using Pos   = BufferMirror::Pos;
+
+  std::map<size_t, std::string> lines;  ///< Predicted text, by line index.
+  Pos cursor;                           ///< The predicted cursor.
+
+  /// Roll back predictions unconfirmed after this long, or four round trips,
+  /// whichever is longer.
+  Clock::duration timeout = std::chrono::milliseconds(250);
+
+  /// Predicts the effect of the curses key `k`.
+  /// @returns false if it can't, in which case nothing is predicted until
+  ///          nvim catches up.
+  bool key(int k, const BufferMirror &);
+
+  /// Called when nvim says something changed, meaning it has processed
+  /// (at least some of) what we sent.
+  void heard_from_nvim();
+
+  /// Confirms or rolls back predictions against the mirror's latest state.
+  void reconcile(const BufferMirror &);
+
+  /// Whether anything is predicted.
+  bool active() const { return predicting; }
+
+  /// Line `i`, with predictions applied.
+  const std::string *line(size_t i, const BufferMirror &) const;
+
+  /// The bytes of line `i` that are predicted but unconfirmed, [first, second).
+  std::pair<size_t,size_t> unconfirmed(size_t i, const BufferMirror &) const;
+
+private:
+  bool predicting = false;
+  bool frozen = false;
+  bool heard  = false;
+  Clock::time_point since;  ///< When the oldest unconfirmed guess was made.
+  Clock::time_point frozenAt;
+
+  bool freeze();
+};
@@ -1,9 +1,13 @@
 
 #include <cstdlib>   // getenv()
 #include <stdio.h>
-#include <unistd.h>  // fork()
+#include <unistd.h>
 #include <fcntl.h>
+#include <sys/eventfd.h>
 
+#include <algorithm>
+#include <cmath>
+#include <deque>
 #include <sstream>
 
 #include "NeoServer.h"
@@ -64,31 +68,33 @@ std::ostream& operator<< (std::ostream& os, const NeoFunc& nf)
   return os;
 }
 
-ScopedLock::ScopedLock(pthread_mutex_t& ref) : m(&ref)
-{
-  pthread_mutex_lock(m);
-}
-
-ScopedLock::~ScopedLock()
-{
-  pthread_mutex_unlock(m);
-}
-
+/// Connects to nvim, if one is listening where we'd expect.
 bool try_connect(NeoServer& serv)
 {
-  // Guess the server's address.
-  const char* laddr = getenv("NEOVIM_LISTEN_ADDRESS");
-  if (laddr && serv.sock.connect_local(laddr)) {
-    serv.address = laddr;
-    return true;
-  }
-  
-  if (serv.sock.connect_local("/tmp/novim")) {
-    serv.address = "/tmp/neovim";
-    return true;
+  using namespace std::chrono;
+
+  // Addresses we were given come first, and are worth waiting for, in case
+  // their nvim is still starting up. The default is only worth a try.
+  std::vector<std::string> addrs;
+  for (const char *var : {"NVIM_LISTEN_ADDRESS", "NEOVIM_LISTEN_ADDRESS"})
+    if (const char *a = getenv(var))
+      addrs.push_back(a);
+  bool named = !addrs.empty();
+  addrs.push_back("/tmp/neovim");
+
+  milliseconds wait(0);
+  if (named) {
+    const char *t = getenv("CVIM_CONNECT_TIMEOUT");  // In milliseconds.
+    wait = milliseconds(t ? atoi(t) : 10000);
   }
 
-  return false;
+  size_t which;
+  serv.sock = connect_any(addrs, steady_clock::now() + wait, &which);
+  if (!serv.sock)
+    return false;
+
+  serv.address = addrs[which];
+  return true;
 }
 
 NeoServer *server = nullptr;
@@ -97,44 +103,37 @@ NeoServer::NeoServer()
 {
   id = 0;
 
-  if (!sock)
-    die_errno("Failed opening socket:\n");
-
   if (!try_connect(*this)) {
-    std::cout << "No neovim instance detected. Attempting to create one." 
+    // Nothing is listening, so run an nvim of our own and talk to it over
+    // its stdin and stdout. That needs no display, and takes no longer than
+    // starting it does.
+    std::cout << "No neovim instance detected. Starting nvim --embed."
               << std::endl;
-
-    // Before failing, let's assume neovim hasn't started yet.
-    pid_t pid = fork();
-    if (pid == -1)
-      die_errno("fork()");
-
-    if (pid == 0) {
-      std::cout << "Starting nvim" << std::endl;
-      execlp("xterm", "xterm", "-e", "nvim", (char *) NULL);
-      die_errno("running nvim");
-    }
-
-    std::cout << "Waiting for client to start..." << std::endl;
-    unsigned int t = 0;
-    while (!try_connect(*this)) { 
-      usleep(200);
-      // Call it quits after ten seconds.
-      if ((t += 200) > 10e9) {
-        std::cerr << "can't connect to server" << std::endl;
-        exit(1);
-      }
-    }
+    sock.reset(new ChildProcess({"nvim", "--embed"}));
+    if (!*sock)
+      die_errno("starting nvim --embed");
+    address = "nvim --embed";
   }
 
+  wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakefd < 0)
+    die_errno("creating wakeup fd with eventfd()");
+
   // Start the thread to read from the server.
   repliesLock = PTHREAD_MUTEX_INITIALIZER;
   notesLock   = PTHREAD_MUTEX_INITIALIZER;
+  handlesLock = PTHREAD_MUTEX_INITIALIZER;
+  cacheLock   = PTHREAD_MUTEX_INITIALIZER;
   newReply    = PTHREAD_COND_INITIALIZER;
   newNote     = PTHREAD_COND_INITIALIZER;
   if (pthread_create(&worker, nullptr, listen, this) != 0)
     die_errno("spawning listener with pthread_create()");
 
+  if (sem_init(&submitted, 0, 0) != 0)
+    die_errno("creating submission semaphore with sem_init()");
+  if (pthread_create(&writer, nullptr, write_out, this) != 0)
+    die_errno("spawning writer with pthread_create()");
+
   std::cout << "Requesting API data...\n";
   Reply res = grab(request(0)).convert();
 
@@ -147,13 +146,51 @@ NeoServer::NeoServer()
   msgpack::object_raw raw = std::get<1>(res).via.raw;
 #endif
 
+  // Only a version of nvim we haven't seen needs its metadata decoded.
+  uint64_t hash = hash_bytes(raw.ptr, raw.size);
+  if (!api.load(hash)) {
+    decode_api(raw.ptr, raw.size);
+    api.build(hash, classList, functionList);
+  }
+
+  // Keystrokes and cursor moves go first; big writes go last.
+  methodLanes.assign(api.size() + 1, NORMAL);
+  for (size_t i = 0; i < api.size(); i++) {
+    std::string name = api.name(i);
+    uint32_t id = api.id(i);
+
+    Lane lane = NORMAL;
+    if (name == "vim_input" || name == "vim_feedkeys"
+        || name == "window_set_cursor")
+      lane = INTERACTIVE;
+    else if (name == "buffer_set_slice")
+      lane = BULK;
+
+    if (methodLanes.size() <= id)
+      methodLanes.resize(id + 1, NORMAL);
+    methodLanes[id] = lane;
+
+    // Getters have no side effects, so identical ones can share a reply.
+    bool get   = name.find("_get_") != std::string::npos;
+    bool valid = name.size() > 9
+                 && name.compare(name.size() - 9, 9, "_is_valid") == 0;
+    if (get || valid) {
+      if (readOnly.size() <= id)
+        readOnly.resize(id + 1);
+      readOnly[id] = true;
+    }
+  }
+}
+
+void NeoServer::decode_api(const char *blob, size_t size)
+{
   msgpack::unpacked up;
-  msgpack::unpack(&up, raw.ptr, raw.size);
+  msgpack::unpack(&up, blob, size);
 
   using Services = std::map<std::string, msgpack::object>;
   Services servicesMap = up.get().convert();
 
-  servicesMap["classes"].convert(&classes);
+  servicesMap["classes"].convert(&classList);
 
   using Fn = std::map<std::string, msgpack::object>;
   std::vector<Fn> fns = servicesMap["functions"].convert();
@@ -166,15 +203,42 @@ NeoServer::NeoServer()
     fn["id"]         .convert(&nf.id);
     fn["parameters"] .convert(&nf.args);
 
-    functions.emplace_back(std::move(nf));
+    functionList.emplace_back(std::move(nf));
+  }
+  apiDecoded = true;
+}
+
+const std::vector<std::string> &NeoServer::classes() const
+{
+  functions();
+  return classList;
+}
+
+const std::vector<NeoFunc> &NeoServer::functions() const
+{
+  ScopedLock l(apiLock);
+  if (!apiDecoded) {
+    for (size_t i = 0; i < api.size(); i++)
+      functionList.push_back(api.function(i));
+    for (size_t i = 0; i < api.class_count(); i++)
+      classList.push_back(api.class_name(i));
+    apiDecoded = true;
   }
+  return functionList;
 }
 
 NeoServer::~NeoServer()
 {
+  // Let the writer finish what's queued.
+  stopping = true;
+  sem_post(&submitted);
+  pthread_join(writer, nullptr);
+  sem_destroy(&submitted);
+
   pthread_cond_destroy(&newReply);
   pthread_cond_destroy(&newNote);
   pthread_cancel(worker);
+  close(wakefd);
 }
 
 std::vector<NeoServer::Reply> NeoServer::pending()
@@ -192,24 +256,149 @@ std::vector<NeoServer::Note> NeoServer::inquire()
   return ret;
 }
 
-uint64_t NeoServer::method_id(const std::string& name)
+void NeoServer::on_note(NoteHandler h)
 {
-  for (const NeoFunc& nf : functions) {
-    if (nf.name == name)
-      return nf.id;
+  ScopedLock l(notesLock);
+  noteHandler = std::move(h);
+}
+
+/// Looks `key` up in `cache`, or asks vim with `ask` and caches the answer.
+/// An answer that raced a change of focus is returned but not kept.
+template<typename Map, typename Ask>
+static uint64_t cached_handle(pthread_mutex_t &lock, const uint64_t &gen,
+                              Map &cache, const typename Map::key_type &key,
+                              Ask ask)
+{
+  uint64_t asked;
+  {
+    ScopedLock l(lock);
+    auto it = cache.find(key);
+    if (it != std::end(cache))
+      return it->second;
+    asked = gen;
   }
 
-  return 0;
+  msgpack::object o = ask();
+  if (o.type != msgpack::type::POSITIVE_INTEGER) {
+    std::cerr << "Expected +int, got (value):" << o << std::endl;
+    return 0;
+  }
+
+  uint64_t h = o.as<uint64_t>();
+  ScopedLock l(lock);
+  if (gen == asked)
+    cache[key] = h;
+  return h;
+}
+
+void NeoServer::watch_focus()
+{
+  {
+    ScopedLock l(handlesLock);
+    if (watchingFocus)
+      return;
+    watchingFocus = true;
+  }
+
+  // A group of our own, so other connections' autocmds are left alone.
+  std::string group = "neoserver" + std::to_string(chan);
+  std::string notify = "call rpcnotify(" + std::to_string(chan)
+                     + ", 'neoserver:focus')";
+  for (const std::string &cmd : {
+         "augroup " + group,
+         std::string("autocmd!"),
+         "autocmd BufEnter,BufWinEnter,WinEnter,TabEnter * " + notify,
+         std::string("augroup END") })
+    discard(request("vim_command", cmd));
+}
+
+uint64_t NeoServer::current_handle(const std::string &prop)
+{
+  watch_focus();
+  return cached_handle(handlesLock, handlesGen, currentHandles, prop, [&] {
+    return grab(request("vim_get_current_" + prop));
+  });
+}
+
+uint64_t NeoServer::window_buffer(uint64_t window)
+{
+  watch_focus();
+  return cached_handle(handlesLock, handlesGen, windowBuffers, window, [&] {
+    return grab(request("window_get_buffer", window));
+  });
+}
+
+void NeoServer::forget_handles()
+{
+  ScopedLock l(handlesLock);
+  currentHandles.clear();
+  windowBuffers.clear();
+  handlesGen++;
+}
+
+void NeoServer::forget_handles_on(const std::string &note)
+{
+  ScopedLock l(handlesLock);
+  focusNotes.insert(note);
+}
+
+std::shared_ptr<void> NeoServer::attachment(
+    const std::string &key,
+    const std::function<std::shared_ptr<void>()> &make)
+{
+  ScopedLock l(attachLock);
+  std::shared_ptr<void> &a = attachments[key];
+  if (!a)
+    a = make();
+  return a;
+}
+
+uint64_t NeoServer::method_id(const std::string& name)
+{
+  return api.find(name);
+}
+
+/// What the reply a thread grab()bed last points into, kept alive until it
+/// grabs another.
+static std::shared_ptr<void> &last_grabbed()
+{
+  thread_local std::shared_ptr<void> owner;
+  return owner;
 }
 
 msgpack::object NeoServer::grab(uint64_t mid)
+{
+  return grab(mid, nullptr);
+}
+
+msgpack::object NeoServer::grab(uint64_t mid, bool *failed)
+{
+  return grab(mid, failed, last_grabbed());
+}
+
+msgpack::object NeoServer::grab(uint64_t mid, bool *failed,
+                                std::shared_ptr<void> &owner)
 {
   ScopedLock l(repliesLock);
   while (true) {
     for (auto& rep : replies) {
       if (std::get<0>(rep) == mid) {
         msgpack::object o = std::get<1>(rep);
+        if (failed)
+          *failed = failures.count(mid);
+        owner = owners[mid];
+
+        // A shared reply stays until its last caller takes it.
+        auto sh = sharers.find(mid);
+        if (sh != std::end(sharers)) {
+          if (--sh->second == 0)
+            sharers.erase(sh);
+          return o;
+        }
+
         replies.remove(rep);  // TODO: remove()/erase()
+        failures.erase(mid);
+        owners.erase(mid);
         return o;
       }
     }
@@ -225,7 +414,18 @@ bool NeoServer::grab_if_ready(uint64_t mid, msgpack::object &o)
   for (auto& rep : replies) {
     if (std::get<0>(rep) == mid) {
       o = std::get<1>(rep);
+      last_grabbed() = owners[mid];
+
+      auto sh = sharers.find(mid);
+      if (sh != std::end(sharers)) {
+        if (--sh->second == 0)
+          sharers.erase(sh);
+        return true;
+      }
+
       replies.remove(rep);  // TODO: remove()/erase()
+      failures.erase(mid);
+      owners.erase(mid);
       return true;
     }
   }
@@ -233,15 +433,410 @@ bool NeoServer::grab_if_ready(uint64_t mid, msgpack::object &o)
   return false;
 }
 
+void NeoServer::discard(uint64_t mid)
+{
+  ScopedLock l(repliesLock);
+
+  // Another caller still wants a shared reply; just stop waiting for us.
+  auto sh = sharers.find(mid);
+  if (sh != std::end(sharers)) {
+    if (--sh->second == 0)
+      sharers.erase(sh);
+    return;
+  }
+
+  auto it = std::find_if(std::begin(replies), std::end(replies),
+                         [&](const Reply &r) { return r.first == mid; });
+  if (it == std::end(replies)) {
+    // Nobody may share it from now on, or they'd wait for it forever.
+    auto fl = inflightKeys.find(mid);
+    if (fl != std::end(inflightKeys)) {
+      auto in = inflight.find(fl->second);
+      if (in != std::end(inflight) && in->second == mid)
+        inflight.erase(in);
+      inflightKeys.erase(fl);
+    }
+    discarded.insert(mid);
+    return;
+  }
+  replies.erase(it);
+  failures.erase(mid);
+  owners.erase(mid);
+}
+
+void NeoServer::cache_replies(const std::string &method, CacheRule rule)
+{
+  uint64_t m = method_id(method);
+  if (!m)
+    return;
+
+  for (const std::string &note : rule.notes)
+    if (note == "neoserver:focus")
+      watch_focus();
+
+  ScopedLock l(cacheLock);
+  for (const std::string &note : rule.notes)
+    cacheNotes[note].push_back(m);
+  for (const std::string &writer : rule.writers)
+    cacheWriters[method_id(writer)].push_back(m);
+  caches[m].rule = std::move(rule);
+  caching = true;
+}
+
+void NeoServer::forget_replies(const std::string &method)
+{
+  ScopedLock l(cacheLock);
+  if (method.empty()) {
+    for (auto &c : caches)
+      clear_caches({c.first});
+  } else {
+    clear_caches({method_id(method)});
+  }
+}
+
+void NeoServer::clear_caches(const std::vector<uint64_t> &methods)
+{
+  for (uint64_t m : methods) {
+    auto it = caches.find(m);
+    if (it != std::end(caches)) {
+      it->second.replies.clear();
+      it->second.gen++;
+    }
+  }
+}
+
+void NeoServer::clear_written(uint64_t method)
+{
+  auto w = cacheWriters.find(method);
+  if (w != std::end(cacheWriters))
+    clear_caches(w->second);
+}
+
+void NeoServer::fill_cache(uint32_t rid, const msgpack::object &o,
+                           bool failed)
+{
+  ScopedLock l(cacheLock);
+  auto f = cacheFills.find(rid);
+  if (f == std::end(cacheFills))
+    return;
+
+  MethodCache &mc = caches[f->second.method];
+  if (!failed && mc.gen == f->second.gen) {
+    // The listener's copy lives only until it's grab()bed, so keep our own.
+    CachedReply r;
+    r.bytes = std::make_shared<msgpack::sbuffer>();
+    msgpack::pack(*r.bytes, o);
+    r.value = std::make_shared<msgpack::unpacked>();
+    msgpack::unpack(r.value.get(), r.bytes->data(), r.bytes->size());
+    r.at = std::chrono::steady_clock::now();
+    mc.replies[f->second.args] = std::move(r);
+  }
+
+  cacheFills.erase(f);
+}
+
+uint64_t NeoServer::submit_request(uint64_t method,
+                                   const msgpack::sbuffer &args)
+{
+  bool fill = false;
+  uint64_t gen = 0;
+  if (caching) {
+    ScopedLock l(cacheLock);
+    clear_written(method);
+
+    auto c = caches.find(method);
+    if (c != std::end(caches)) {
+      MethodCache &mc = c->second;
+      auto r = mc.replies.find(std::string(args.data(), args.size()));
+      auto now = std::chrono::steady_clock::now();
+
+      if (r != std::end(mc.replies) && now - r->second.at < mc.rule.ttl) {
+        // Answer it ourselves, under an id nvim never sees.
+        msgpack::object o = r->second.value->get();
+        uint32_t mid = id++;
+        cacheHits++;
+
+        ScopedLock rl(repliesLock);
+        replies.emplace_back(mid, o);
+        owners[mid] = std::make_shared<CachedReply>(r->second);
+        pthread_cond_broadcast(&newReply);
+        return mid;
+      }
+
+      if (r != std::end(mc.replies))
+        mc.replies.erase(r);
+      cacheMisses++;
+      fill = true;
+      gen  = mc.gen;
+    }
+  }
+
+  bool shareable = method < readOnly.size() && readOnly[method];
+
+  uint32_t mid;
+  if (shareable) {
+    std::string key((const char *) &method, sizeof method);
+    key.append(args.data(), args.size());
+
+    ScopedLock l(repliesLock);
+    auto it = inflight.find(key);
+    if (it != std::end(inflight)) {
+      sharers[it->second]++;
+      deduplicated++;
+      return it->second;
+    }
+
+    // Registered before it's sent, so the reply can't beat us to it.
+    mid = id++;
+    inflightKeys.emplace(mid, key);
+    inflight.emplace(std::move(key), mid);
+  } else {
+    forget_inflight();
+    mid = id++;
+  }
+
+  if (fill) {
+    ScopedLock l(cacheLock);
+    cacheFills[mid] = {method, gen, std::string(args.data(), args.size())};
+  }
+
+  thread_local msgpack::sbuffer header(32);
+  header.clear();
+  detail::Packer pk(&header);
+  pk.pack_array(4) << (uint64_t)REQUEST
+                   << mid
+                   << method;
+
+  Submission *s = new Submission;
+  s->lane = lane_of(method);
+  s->bytes.reserve(header.size() + args.size());
+  s->bytes.append(header.data(), header.size());
+  s->bytes.append(args.data(), args.size());
+  submit(s);
+
+  return mid;
+}
+
+void NeoServer::forget_inflight()
+{
+  ScopedLock l(repliesLock);
+  inflight.clear();
+}
+
+void NeoServer::submit_and_wait(std::vector<iovec> iov, Lane lane)
+{
+  sem_t done;
+  sem_init(&done, 0, 0);
+
+  Submission *s = new Submission;
+  s->iov  = std::move(iov);
+  s->done = &done;
+  s->lane = lane;
+  submit(s);
+
+  while (sem_wait(&done) != 0)
+    ;  // EINTR
+  sem_destroy(&done);
+}
+
+/// A number for the calling thread, unique within the process.
+static uint32_t thread_number()
+{
+  static std::atomic<uint32_t> next{0};
+  thread_local uint32_t n = next++;
+  return n;
+}
+
+void NeoServer::submit(Submission *s)
+{
+  s->queued = std::chrono::steady_clock::now();
+  s->thread = thread_number();
+  s->seq    = nextSeq++;
+
+  // Only the writer pops, and it takes everything, so there's no ABA.
+  std::atomic<Submission *> &stack = submissions[s->lane];
+  s->next = stack.load(std::memory_order_relaxed);
+  while (!stack.compare_exchange_weak(s->next, s,
+                                      std::memory_order_release,
+                                      std::memory_order_relaxed))
+    ;
+
+  sem_post(&submitted);
+}
+
+/// -1 when no LaneScope is active on this thread.
+static thread_local int laneOverride = -1;
+
+NeoServer::LaneScope::LaneScope(Lane lane) : saved(laneOverride)
+{
+  laneOverride = lane;
+}
+
+NeoServer::LaneScope::~LaneScope()
+{
+  laneOverride = saved;
+}
+
+NeoServer::Lane NeoServer::lane_of(uint64_t method) const
+{
+  if (laneOverride >= 0)
+    return (Lane) laneOverride;
+  return method < methodLanes.size() ? methodLanes[method] : NORMAL;
+}
+
+void NeoServer::LaneStats::add(std::chrono::steady_clock::duration d)
+{
+  uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(d)
+                  .count();
+  int b = 0;
+  while (b < 31 && (uint64_t) 1 << b <= us)
+    b++;
+  buckets[b].fetch_add(1, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+}
+
+double NeoServer::LaneStats::quantile(double q) const
+{
+  uint64_t n = count.load(std::memory_order_relaxed);
+  uint64_t want = std::ceil(q * n), seen = 0;
+  for (int b = 0; b < 32; b++) {
+    seen += buckets[b].load(std::memory_order_relaxed);
+    if (seen >= want && seen > 0)
+      return ((uint64_t) 1 << b) * 1e-6;
+  }
+  return 0;
+}
+
+void NeoServer::write_batch(std::vector<Submission *> &batch)
+{
+  thread_local std::vector<iovec> iov;
+  iov.clear();
+  for (Submission *p : batch) {
+    if (p->bytes.empty())
+      iov.insert(std::end(iov), std::begin(p->iov), std::end(p->iov));
+    else
+      iov.push_back({(void *) p->bytes.data(), p->bytes.size()});
+  }
+
+  if (!sock->send_all(iov.data(), iov.size()))
+    std::cerr << "Failed sending to vim: " << socket_error_msg() << '\n';
+
+  auto now = std::chrono::steady_clock::now();
+  for (Submission *p : batch) {
+    laneStats[p->lane].add(now - p->queued);
+    if (p->done)
+      sem_post(p->done);
+    delete p;
+  }
+  batch.clear();
+}
+
+void *NeoServer::write_out(void *pthis)
+{
+  NeoServer& self = *reinterpret_cast<NeoServer*>(pthis);
+
+  // What's waiting, per submitting thread, in the order it was submitted.
+  std::map<uint32_t, std::deque<Submission *>> queues;
+
+  // Moves every stack onto the ends of the queues. A thread's submissions
+  // always come after those of its we already took.
+  std::vector<Submission *> taken;
+  auto take = [&] {
+    taken.clear();
+    for (int l = 0; l < LANES; l++) {
+      Submission *s = self.submissions[l].exchange(nullptr,
+                                                   std::memory_order_acquire);
+      for (; s; s = s->next)
+        taken.push_back(s);
+    }
+    std::sort(std::begin(taken), std::end(taken),
+              [](const Submission *a, const Submission *b) {
+                return a->seq < b->seq;
+              });
+    for (Submission *s : taken)
+      queues[s->thread].push_back(s);
+    return !taken.empty();
+  };
+
+  // A submission with the lane it effectively has: none may go before those
+  // its thread submitted earlier, so it's held back to the lowest of theirs.
+  using Ready = std::pair<int, Submission *>;
+  std::vector<Ready> ready;
+
+  std::vector<Submission *> batch;
+  while (true) {
+    if (sem_wait(&self.submitted) != 0)
+      continue;  // EINTR
+
+    if (!take() && queues.empty()) {
+      // Posts outnumber batches; most wake-ups find nothing left.
+      if (self.stopping)
+        break;
+      continue;
+    }
+
+    while (!queues.empty()) {
+      // Everything interactive and normal that isn't stuck behind its own
+      // thread's bulk messages goes out together, interactive first.
+      ready.clear();
+      for (auto &q : queues) {
+        int lane = INTERACTIVE;
+        while (!q.second.empty() && q.second.front()->lane != BULK) {
+          lane = std::max<int>(lane, q.second.front()->lane);
+          ready.emplace_back(lane, q.second.front());
+          q.second.pop_front();
+        }
+      }
+      std::sort(std::begin(ready), std::end(ready),
+                [](const Ready &a, const Ready &b) {
+                  return a.first != b.first ? a.first < b.first
+                                            : a.second->seq < b.second->seq;
+                });
+      for (const Ready &r : ready)
+        batch.push_back(r.second);
+
+      for (auto it = std::begin(queues); it != std::end(queues); )
+        it = it->second.empty() ? queues.erase(it) : std::next(it);
+
+      // Bulk messages go one at a time, oldest first, looking for more
+      // urgent ones between. By now every queue starts with one.
+      if (batch.empty()) {
+        auto oldest = std::min_element(
+          std::begin(queues), std::end(queues),
+          [](const std::pair<const uint32_t, std::deque<Submission *>> &a,
+             const std::pair<const uint32_t, std::deque<Submission *>> &b) {
+            return a.second.front()->seq < b.second.front()->seq;
+          });
+        batch.push_back(oldest->second.front());
+        oldest->second.pop_front();
+        if (oldest->second.empty())
+          queues.erase(oldest);
+      }
+
+      self.write_batch(batch);
+      take();
+    }
+  }
+
+  return nullptr;
+}
+
 void *NeoServer::listen(void *pthis)
 {
   NeoServer& self = *reinterpret_cast<NeoServer*>(pthis);
 
   msgpack::unpacker up;
-  msgpack::unpacked un;
-  while (self.sock.recv(up)) {
-    while (up.next(&un)) {
-      msgpack::object_array reply_ar = un.get().via.array;
+  auto un = std::make_shared<msgpack::unpacked>();
+  while (self.sock->recv(up)) {
+    while (true) {
+      // A reply owns the zone it was unpacked into until it's grab()bed, so
+      // the next message can't reuse it meanwhile.
+      if (un.use_count() > 1)
+        un = std::make_shared<msgpack::unpacked>();
+      if (!up.next(un.get()))
+        break;
+
+      msgpack::object_array reply_ar = un->get().via.array;
       auto reply = [&](size_t i) { return reply_ar.ptr[i]; };
       size_t len = reply_ar.size;
 
@@ -253,15 +848,59 @@ void *NeoServer::listen(void *pthis)
         uint64_t rid = reply(1).convert();
         msgpack::object val = reply( reply(2).is_nil() ? 3 : 2 );
 
+        if (self.caching)
+          self.fill_cache(rid, val, !reply(2).is_nil());
+
         ScopedLock l(self.repliesLock);
+
+        // Answered; later reads must ask again.
+        auto fl = self.inflightKeys.find(rid);
+        if (fl != std::end(self.inflightKeys)) {
+          // Unless a write made a newer request take its place.
+          auto it = self.inflight.find(fl->second);
+          if (it != std::end(self.inflight) && it->second == rid)
+            self.inflight.erase(it);
+          self.inflightKeys.erase(fl);
+        }
+
+        // Nobody is going to grab() it.
+        if (self.discarded.erase(rid))
+          continue;
+
         self.replies.emplace_back(rid, val);
+        self.owners[rid] = un;
+        if (!reply(2).is_nil())
+          self.failures.insert(rid);
         pthread_cond_signal(&self.newReply);  // Signal grab() to try again.
       } else if (reply(0) == NOTIFY && len == 3) {
         ScopedLock l(self.notesLock);
         // A msgpack notification looks like: (NOTIFY, name, args)
-        self.notifications.emplace_back(reply(1).as<std::string>(), 
-                                        reply(2));
+        std::string name = reply(1).as<std::string>();
+        bool focus;
+        {
+          ScopedLock h(self.handlesLock);
+          focus = self.focusNotes.count(name);
+        }
+        if (focus)
+          self.forget_handles();
+
+        if (self.caching) {
+          ScopedLock c(self.cacheLock);
+          auto it = self.cacheNotes.find(name);
+          if (it != std::end(self.cacheNotes))
+            self.clear_caches(it->second);
+        }
+        if (name == "neoserver:focus")
+          continue;  // Ours alone.
+        if (self.noteHandler && self.noteHandler(name, reply(2)))
+          continue;
+
+        self.notifications.emplace_back(std::move(name), reply(2));
         pthread_cond_signal(&self.newNote);
+
+        uint64_t one = 1;
+        if (write(self.wakefd, &one, sizeof one) < 0 && errno != EAGAIN)
+          std::cerr << "Failed to signal wakeup fd\n";
       } else {
         std::cerr << "Unknown message type (" << reply(0).via.u64 << ")\n";
       }
@@ -275,8 +914,5 @@ void *NeoServer::listen(void *pthis)
 
 Data current(NeoServer &serv, const std::string &prop)
 {
-  auto idObj = serv.grab(serv.request("vim_get_current_" + prop));
-  if (idObj.type != msgpack::type::POSITIVE_INTEGER)
-    std::cerr << "Expected +int, got (value):" << idObj << std::endl;
-  return {serv, prop, idObj.as<uint64_t>()};
+  return {serv, prop, serv.current_handle(prop)};
 }
@@ -1,10 +1,21 @@
+#pragma once
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <msgpack.hpp>
+#include <semaphore.h>
 
+#include "ApiCache.h"
+#include "ScopedLock.h"
 #include "Socket.h"
 
 namespace std {
@@ -39,25 +50,34 @@ struct NeoFunc
 std::ostream& operator<< (std::ostream&, const NeoFunc::Param&);
 std::ostream& operator<< (std::ostream& os, const NeoFunc& nf);
 
-struct ScopedLock
-{
-  pthread_mutex_t* m;
-  ScopedLock(pthread_mutex_t&);
-  ~ScopedLock();
-};
-
 /// Manages the state of a connection to a running instance of nvim.
 ///
 /// The constructor makes a connection to vim and spawns a thread to listen for
-/// responses. It fills `classes` and `functions` by downloading the API data
-/// from the running vim instance.
+/// responses. It downloads the API data from the running vim instance, but
+/// only decodes it the first time nvim sends that version of it; after that
+/// it's read from a cache on disk (see ApiTable), and classes() and
+/// functions() are only built if asked for.
 ///
 /// request(id,args) sends data to vim and returns the message id, which can be
 /// sent to grab() to obtain the response. Since a message may be missed or
 /// come out of order, it may be desirable to run it in another thread.
 ///
-/// @remark Assumes neovim server is at /tmp/neovim, or checks
-///         $NEOVIM_LISTEN_ADDRESS.
+/// Any number of threads may call request() at once. Each encodes its message
+/// in a buffer of its own and pushes it onto a lock-free queue; a writer thread
+/// sends everything queued so far with one writev().
+///
+/// Identical requests to getters that are in flight at the same time are only
+/// sent once; every caller gets an id for the same reply, and each grab()s it.
+/// A read made after any other request is never shared with one made before,
+/// since that request may have changed the answer.
+/// Methods named with cache_replies() go further, and are answered from
+/// memory until a notification, a writing request or a TTL says otherwise.
+///
+/// @remark Looks for nvim at $NVIM_LISTEN_ADDRESS or $NEOVIM_LISTEN_ADDRESS
+///         (a unix socket, or host:port for TCP), waiting for it to appear
+///         for up to $CVIM_CONNECT_TIMEOUT milliseconds (ten seconds by
+///         default), and at /tmp/neovim. If none answers, it starts
+///         `nvim --embed` and talks to it over pipes.
 struct NeoServer
 {
   /// The data of a NOTIFY message.
@@ -66,14 +86,19 @@ struct NeoServer
   /// The type returned by request().
   using Reply = std::pair<uint64_t, msgpack::object>;
 
-  uint32_t id;    ///< The id of the next message.
-  uint32_t chan;  ///< The channel we communicate through.
+  std::atomic<uint32_t> id;  ///< The id of the next message.
+  uint32_t chan;             ///< The channel we communicate through.
+
+  std::unique_ptr<Transport> sock;
+  std::string address;        ///< Where `sock` goes, for people to read.
 
-  UnixSocket sock;
-  std::string address;
+  /// An eventfd that becomes readable whenever a notification arrives, so a
+  /// front-end can poll() it alongside its own input. Read it to reset it.
+  int wakefd;
 
-  std::vector<std::string> classes;
-  std::vector<NeoFunc>     functions;
+  /// The API, decoded on first use.
+  const std::vector<std::string> &classes() const;
+  const std::vector<NeoFunc>     &functions() const;
 
   NeoServer();
   ~NeoServer();
@@ -90,6 +115,101 @@ struct NeoServer
   /// Gets all notifications.
   std::vector<Note> inquire();
 
+  /// Called from the listener thread with each notification as it arrives,
+  /// before it is queued for inquire(). Returning true consumes it.
+  using NoteHandler = std::function<bool(const std::string &,
+                                         const msgpack::object &)>;
+
+  /// Outgoing requests are sent by priority. Whatever is queued in a higher
+  /// lane goes out first, so a keystroke never waits behind another thread's
+  /// big upload. A request only ever overtakes those made by other threads:
+  /// each thread's requests reach nvim in the order it made them, so it
+  /// always reads its own writes.
+  enum Lane {
+    INTERACTIVE,  ///< Input and cursor moves; by default, vim_input and co.
+    NORMAL,
+    BULK,         ///< Large transfers, like request_lines().
+    LANES
+  };
+
+  /// While in scope, requests made by this thread go in `lane`, rather than
+  /// the lane their method defaults to.
+  struct LaneScope
+  {
+    int saved;
+    LaneScope(Lane);
+    ~LaneScope();
+  };
+
+  /// How long requests waited to be written, per lane, counted in buckets
+  /// of powers of two microseconds.
+  struct LaneStats
+  {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> buckets[32]{};
+
+    void add(std::chrono::steady_clock::duration);
+
+    /// The wait below which fraction `q` of requests fell, in seconds; at
+    /// most twice the real value.
+    double quantile(double q) const;
+  };
+
+  LaneStats laneStats[LANES];
+
+  /// Requests that shared a reply with an identical one in flight.
+  std::atomic<size_t> deduplicated{0};
+
+  /// When the cached replies to a method go stale.
+  struct CacheRule
+  {
+    std::vector<std::string> notes;    ///< Notifications that clear them.
+    std::vector<std::string> writers;  ///< Methods whose requests clear them.
+
+    /// How long a reply may be served for, even if nothing clears it.
+    std::chrono::steady_clock::duration ttl = std::chrono::seconds(1);
+  };
+
+  /// Serves requests to `method` from memory, for replies seen before, until
+  /// `rule` says they're stale. Replies are cached per set of arguments.
+  /// A rule may name neoserver:focus (see current_handle()) among its notes.
+  void cache_replies(const std::string &method, CacheRule rule);
+
+  /// Drops the cached replies to `method`, or, by default, all of them.
+  void forget_replies(const std::string &method="");
+
+  std::atomic<size_t> cacheHits{0};    ///< Requests answered from the cache.
+  std::atomic<size_t> cacheMisses{0};  ///< Cacheable requests sent anyway.
+
+  /// Sets (or, given nullptr, clears) the NoteHandler.
+  void on_note(NoteHandler);
+
+  /// The current "tabpage", "window" or "buffer". Only the first call after
+  /// a change of focus costs a round trip.
+  ///
+  /// The first call also sets up autocmds that send us "neoserver:focus"
+  /// whenever focus moves, which empties the cache. That notification is
+  /// handled here, and never reaches inquire().
+  uint64_t current_handle(const std::string &prop);
+
+  /// The buffer shown in `window`, cached like current_handle().
+  uint64_t window_buffer(uint64_t window);
+
+  /// Empties the handle cache, for when we change focus ourselves.
+  void forget_handles();
+
+  /// Names a notification that means focus or the layout may have changed.
+  /// Each one that arrives empties the handle cache, as do redraw:layout and
+  /// neoserver:focus.
+  void forget_handles_on(const std::string &note);
+
+  /// Gets the state another module keeps for this connection under `key`,
+  /// such as a LineCache, making it with `make` the first time. It lives as
+  /// long as the NeoServer does.
+  std::shared_ptr<void> attachment(const std::string &key,
+                                   const std::function<std::shared_ptr<void>()>
+                                     &make);
+
   /// Gets the id of a function for use with request().
   /// @returns non-zero on success
   /// @returns zero when the function is not found
@@ -114,11 +234,37 @@ struct NeoServer
   template<typename V=std::vector<msgpack::object>>
   uint64_t request_with(const std::string&, const V& v={});
 
+  /// Requests method(t..., lines[from, to)) without copying the lines: only
+  /// the msgpack headers are encoded, and writev() reads the text straight
+  /// out of `lines`. Returns once the request has been written, after which
+  /// `lines` may change.
+  /// @return The id to expect a response with.
+  template<typename...T>
+  uint64_t request_lines(uint64_t, const std::vector<std::string> &lines,
+                         size_t from, size_t to, const T&...t);
+
   /// Pull a specific reply from `replies`.
+  ///
+  /// Strings, arrays and maps in it stay valid until the calling thread
+  /// grab()s another reply; convert it before then, or use the overload that
+  /// hands over its `owner`.
   msgpack::object grab(uint64_t);
 
+  /// Like grab(), but also sets `failed` if vim replied with an error, in
+  /// which case the object is the error rather than a result.
+  msgpack::object grab(uint64_t, bool *failed);
+
+  /// Like grab(), but the reply stays valid for as long as `owner` is kept,
+  /// for a caller holding several at once.
+  msgpack::object grab(uint64_t, bool *failed, std::shared_ptr<void> &owner);
+
+  /// Like grab(), but only if the reply is there already.
   bool grab_if_ready(uint64_t, msgpack::object &);
 
+  /// Drops the reply to a request, now or whenever it arrives, for a caller
+  /// that won't grab() it after all.
+  void discard(uint64_t);
+
   template<typename T>
   void grab(uint64_t id, T& x)
   {
@@ -131,11 +277,144 @@ private:
   static void *listen(void *);
   pthread_t worker;             ///< runs `listen()`
 
+  /// An encoded message waiting to be written: either `bytes`, or, if that is
+  /// empty, whatever `iov` points to, which must stay valid until `done` is
+  /// posted.
+  struct Submission
+  {
+    Submission *next;
+    std::string bytes;
+    std::vector<iovec> iov;
+    sem_t *done = nullptr;
+    Lane lane = NORMAL;
+    std::chrono::steady_clock::time_point queued;
+    uint32_t thread;  ///< Which thread submitted it.
+    uint64_t seq;     ///< When, relative to every other submission.
+  };
+
+  /// Queues a message for write_out().
+  void submit(Submission *);
+
+  /// Queues a request for `method` with the already encoded `args`, unless
+  /// an identical read is in flight, in which case the caller shares its
+  /// reply.
+  /// @return The id to expect a response with.
+  uint64_t submit_request(uint64_t method, const msgpack::sbuffer &args);
+
+  /// Stops later reads from sharing replies with those in flight; for when
+  /// a request that may change their answers goes out.
+  void forget_inflight();
+
+  /// Queues a message made of borrowed memory and waits until it's written.
+  void submit_and_wait(std::vector<iovec>, Lane);
+
+  /// Ran in a separate thread, sends whatever submit() queued, in order of
+  /// lane, then of submission, but never one thread's requests out of order.
+  static void *write_out(void *);
+  pthread_t writer;                       ///< runs `write_out()`
+
+  /// Writes `batch` in one go, then frees it.
+  void write_batch(std::vector<Submission *> &batch);
+
+  /// The lane a request to `method` goes in.
+  Lane lane_of(uint64_t method) const;
+  std::vector<Lane> methodLanes;  ///< By method id; NORMAL if not listed.
+
+  /// For each lane, a stack of submissions, newest first, pushed to with
+  /// compare-and-swap and emptied all at once by the writer.
+  std::atomic<Submission *> submissions[LANES]{};
+  sem_t submitted;                        ///< Posted once per submission.
+  std::atomic<uint64_t> nextSeq{0};
+  std::atomic<bool> stopping{false};
+
   std::list<Reply> replies;     ///< Replies waiting to get grab()ed.
+  std::set<uint64_t> failures;  ///< Which of them are errors.
+
+  /// What each of `replies` points into: the message the listener unpacked
+  /// it from, or a CachedReply, which may leave the cache first.
+  std::unordered_map<uint64_t, std::shared_ptr<void>> owners;
+  std::set<uint64_t> discarded; ///< Replies to drop as they arrive.
+
+  /// The API as nvim described it, and decoded in full, once asked for.
+  ApiTable api;
+  mutable std::vector<std::string> classList;
+  mutable std::vector<NeoFunc>     functionList;
+  mutable bool apiDecoded = false;
+  mutable pthread_mutex_t apiLock = PTHREAD_MUTEX_INITIALIZER;
+
+  /// Decodes the metadata blob nvim sent, the slow way.
+  void decode_api(const char *blob, size_t size);
+
+  /// Methods whose requests may share a reply, indexed by method id.
+  std::vector<bool> readOnly;
+
+  /// Reads sent but not yet answered, keyed by method id and encoded args,
+  /// and the reverse, to forget them once answered.
+  std::unordered_map<std::string, uint32_t> inflight;
+  std::unordered_map<uint32_t, std::string> inflightKeys;
+
+  /// How many more grab()s a shared reply has to wait for.
+  std::unordered_map<uint64_t, unsigned> sharers;
+
+  /// A copy of a reply, owned by the cache.
+  struct CachedReply
+  {
+    std::shared_ptr<msgpack::sbuffer>  bytes;  ///< What `value` points into.
+    std::shared_ptr<msgpack::unpacked> value;
+    std::chrono::steady_clock::time_point at;
+  };
+
+  struct MethodCache
+  {
+    CacheRule rule;
+    uint64_t gen = 0;  ///< Bumped whenever the replies are cleared.
+    std::unordered_map<std::string, CachedReply> replies;  ///< By args.
+  };
+
+  /// A request whose reply should go in the cache, unless it was cleared
+  /// (changing `gen`) while the request was out.
+  struct CacheFill
+  {
+    uint64_t method;
+    uint64_t gen;
+    std::string args;
+  };
+
+  std::atomic<bool> caching{false};  ///< Whether any method is cached.
+  std::unordered_map<uint64_t, MethodCache> caches;  ///< By method id.
+  std::unordered_map<std::string, std::vector<uint64_t>> cacheNotes;
+  std::unordered_map<uint64_t, std::vector<uint64_t>>    cacheWriters;
+  std::unordered_map<uint32_t, CacheFill> cacheFills;  ///< By request id.
+  pthread_mutex_t cacheLock;
+
+  /// Clears the cache of every method in `methods`; cacheLock must be held.
+  void clear_caches(const std::vector<uint64_t> &methods);
+
+  /// Clears the caches a request to `method` makes stale, as its CacheRule
+  /// `writers` say; cacheLock must be held.
+  void clear_written(uint64_t method);
+
+  /// Puts the reply to request `rid` in the cache, if it was waited for.
+  void fill_cache(uint32_t rid, const msgpack::object &, bool failed);
   pthread_mutex_t repliesLock;  ///< New reply from vim available.
   pthread_cond_t newReply;      ///< New reply from vim available.
 
+  /// Cached handles: current ones by property, and window -> buffer.
+  std::map<std::string, uint64_t> currentHandles;
+  std::map<uint64_t, uint64_t>    windowBuffers;
+  uint64_t handlesGen = 0;  ///< Bumped on every change of focus.
+  std::set<std::string> focusNotes{"redraw:layout", "neoserver:focus"};
+  bool watchingFocus = false;  ///< Whether our autocmds are set up.
+  pthread_mutex_t handlesLock;
+
+  /// Sets up the autocmds behind neoserver:focus, the first time.
+  void watch_focus();
+
+  std::map<std::string, std::shared_ptr<void>> attachments;
+  pthread_mutex_t attachLock = PTHREAD_MUTEX_INITIALIZER;
+
   std::list<Note>  notifications;
+  NoteHandler noteHandler;
   pthread_mutex_t notesLock;
   pthread_cond_t newNote;
 };
@@ -202,27 +481,30 @@ Packer& pack(Packer& pk, const X &x, const Y &y, const Z &...z)
 }
 
 
-static Packer& pack(Packer& pk)
+inline Packer& pack(Packer& pk)
 {
   return pk;
 }
+
+/// Each thread packs its requests into its own buffer, which keeps its
+/// capacity from one request to the next.
+inline msgpack::sbuffer &encode_buffer()
+{
+  thread_local msgpack::sbuffer sbuf;
+  sbuf.clear();
+  return sbuf;
+}
 } // namespace detail
 
 template<typename...T>
 uint64_t NeoServer::request(uint64_t method, const T&...t)
 {
-  msgpack::sbuffer sbuf;
-  detail::Packer pk(&sbuf);
-  pk.pack_array(4) << (uint64_t)REQUEST
-                   << id
-                   << method;
-
+  msgpack::sbuffer &args = detail::encode_buffer();
+  detail::Packer pk(&args);
   pk.pack_array(sizeof...(t));
   detail::pack(pk, t...);
 
-  sock.send(sbuf);
-
-  return id++;
+  return submit_request(method, args);
 }
 
 template<typename...T>
@@ -241,16 +523,67 @@ Ret NeoServer::demand(const std::string& method, const T&...t)
 template<typename V>
 uint64_t NeoServer::request_with(uint64_t method, const V& v)
 {
-  msgpack::sbuffer sbuf;
+  msgpack::sbuffer &args = detail::encode_buffer();
+  detail::Packer pk(&args);
+  pk << v;
+
+  return submit_request(method, args);
+}
+
+template<typename...T>
+uint64_t NeoServer::request_lines(uint64_t method,
+                                  const std::vector<std::string> &lines,
+                                  size_t from, size_t to, const T&...t)
+{
+  forget_inflight();
+  if (caching) {
+    ScopedLock l(cacheLock);
+    clear_written(method);
+  }
+  uint32_t mid = id++;
+
+  // Every header goes in one buffer, remembered by offset since the buffer
+  // moves as it grows; each line's bytes are only pointed to.
+  msgpack::sbuffer &sbuf = detail::encode_buffer();
   detail::Packer pk(&sbuf);
   pk.pack_array(4) << (uint64_t)REQUEST
-                   << id
-                   << method
-                   << v;
+                   << mid
+                   << method;
+
+  pk.pack_array(sizeof...(t) + 1);
+  detail::pack(pk, t...);
+  pk.pack_array(to - from);
+
+  std::vector<size_t> ends;  // Where each line's header ends.
+  ends.reserve(to - from);
+  for (size_t i = from; i < to; i++) {
+#if MSGPACK_VERSION_MINOR >= 6
+    pk.pack_str(lines[i].size());
+#else
+    pk.pack_raw(lines[i].size());
+#endif
+    ends.push_back(sbuf.size());
+  }
+
+  const char *hdr = sbuf.data();
+  std::vector<iovec> iov;
+  iov.reserve(2 * (to - from) + 1);
+
+  // The first line's header carries the request's along with it.
+  size_t start = 0;
+  for (size_t i = from; i < to; i++) {
+    size_t end = ends[i - from];
+    iov.push_back({(void *) (hdr + start), end - start});
+    if (!lines[i].empty())
+      iov.push_back({(void *) lines[i].data(), lines[i].size()});
+    start = end;
+  }
+  if (ends.empty())
+    iov.push_back({(void *) hdr, sbuf.size()});
 
-  sock.send(sbuf);
+  submit_and_wait(std::move(iov), BULK);
 
-  return id++;
+  return mid;
 }
 
 template<typename V>
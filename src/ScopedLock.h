@@ -0,0 +1,12 @@
+#pragma once
+
+#include <pthread.h>
+
+/// Holds a mutex locked for as long as it's in scope.
+struct ScopedLock
+{
+  pthread_mutex_t* m;
+
+  ScopedLock(pthread_mutex_t& ref) : m(&ref) { pthread_mutex_lock(m); }
+  ~ScopedLock() { pthread_mutex_unlock(m); }
+};
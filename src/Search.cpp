@@ -0,0 +1,361 @@
+#include "Search.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <functional>
+
+#include "WorkerPool.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_DISPATCH
+#endif
+
+using Byte = unsigned char;
+
+static const size_t npos = -1;
+
+static Byte lower(Byte c)
+{
+  return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+static bool is_alpha(Byte c)
+{
+  c |= 0x20;
+  return c >= 'a' && c <= 'z';
+}
+
+static bool same(const Byte *p, const Byte *q, size_t n, bool icase)
+{
+  if (!icase)
+    return std::memcmp(p, q, n) == 0;
+  for (size_t i = 0; i < n; i++)
+    if (lower(p[i]) != lower(q[i]))
+      return false;
+  return true;
+}
+
+static size_t find_scalar(const Byte *h, size_t n, const Byte *nd, size_t m,
+                          bool icase)
+{
+  if (m > n)
+    return npos;
+  for (size_t i = 0; i + m <= n; i++)
+    if (same(h + i, nd, m, icase))
+      return i;
+  return npos;
+}
+
+/// For a case-insensitive search, a letter is compared with its 0x20 bit set
+/// so both cases pass; that lets a few other bytes through too, which the
+/// full compare weeds out. These give the bit to set and the byte to expect.
+static Byte fold_mask(Byte c, bool icase)
+{
+  return icase && is_alpha(c) ? 0x20 : 0;
+}
+
+static Byte fold(Byte c, bool icase)
+{
+  return c | fold_mask(c, icase);
+}
+
+#if defined(__SSE2__)
+static size_t find_sse2(const Byte *h, size_t n, const Byte *nd, size_t m,
+                        bool icase)
+{
+  const __m128i fm = _mm_set1_epi8(fold_mask(nd[0], icase));
+  const __m128i lm = _mm_set1_epi8(fold_mask(nd[m - 1], icase));
+  const __m128i f  = _mm_set1_epi8(fold(nd[0], icase));
+  const __m128i l  = _mm_set1_epi8(fold(nd[m - 1], icase));
+
+  size_t i = 0;
+  for (; i + m + 15 <= n; i += 16) {
+    __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *) (h + i)), fm);
+    __m128i b = _mm_or_si128(
+        _mm_loadu_si128((const __m128i *) (h + i + m - 1)), lm);
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, f), _mm_cmpeq_epi8(b, l)));
+
+    while (mask) {
+      size_t at = i + __builtin_ctz(mask);
+      if (same(h + at, nd, m, icase))
+        return at;
+      mask &= mask - 1;
+    }
+  }
+
+  size_t r = find_scalar(h + i, n - i, nd, m, icase);
+  return r == npos ? npos : i + r;
+}
+#endif
+
+#if defined(HAVE_AVX2_DISPATCH)
+__attribute__((target("avx2")))
+static size_t find_avx2(const Byte *h, size_t n, const Byte *nd, size_t m,
+                        bool icase)
+{
+  const __m256i fm = _mm256_set1_epi8(fold_mask(nd[0], icase));
+  const __m256i lm = _mm256_set1_epi8(fold_mask(nd[m - 1], icase));
+  const __m256i f  = _mm256_set1_epi8(fold(nd[0], icase));
+  const __m256i l  = _mm256_set1_epi8(fold(nd[m - 1], icase));
+
+  size_t i = 0;
+  for (; i + m + 31 <= n; i += 32) {
+    __m256i a = _mm256_or_si256(
+        _mm256_loadu_si256((const __m256i *) (h + i)), fm);
+    __m256i b = _mm256_or_si256(
+        _mm256_loadu_si256((const __m256i *) (h + i + m - 1)), lm);
+    unsigned mask = _mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(a, f), _mm256_cmpeq_epi8(b, l)));
+
+    while (mask) {
+      size_t at = i + __builtin_ctz(mask);
+      if (same(h + at, nd, m, icase))
+        return at;
+      mask &= mask - 1;
+    }
+  }
+
+  size_t r = find_sse2(h + i, n - i, nd, m, icase);
+  return r == npos ? npos : i + r;
+}
+#endif
+
+using Find = size_t (*)(const Byte *, size_t, const Byte *, size_t, bool);
+
+static Find pick_find()
+{
+#if defined(HAVE_AVX2_DISPATCH)
+  if (__builtin_cpu_supports("avx2"))
+    return find_avx2;
+#endif
+#if defined(__SSE2__)
+  return find_sse2;
+#else
+  return find_scalar;
+#endif
+}
+
+size_t find_literal(const char *hay, size_t n, const std::string &needle,
+                    bool icase)
+{
+  static const Find find = pick_find();
+  if (needle.empty())
+    return 0;
+  if (needle.size() > n)
+    return npos;
+  return find((const Byte *) hay, n, (const Byte *) needle.data(),
+              needle.size(), icase);
+}
+
+size_t find_literal_scalar(const char *hay, size_t n,
+                           const std::string &needle, bool icase)
+{
+  return find_scalar((const Byte *) hay, n, (const Byte *) needle.data(),
+                     needle.size(), icase);
+}
+
+std::vector<std::pair<size_t,size_t>> find_all(const std::string &line,
+                                               const SearchPattern &p)
+{
+  std::vector<std::pair<size_t,size_t>> found;
+  size_t m = p.literal.size();
+  if (m == 0)
+    return found;
+
+  size_t from = 0;
+  while (from + m <= line.size()) {
+    size_t at = find_literal(line.data() + from, line.size() - from,
+                             p.literal, p.icase);
+    if (at == npos)
+      break;
+    found.emplace_back(from + at, from + at + m);
+    from += at + m;
+  }
+  return found;
+}
+
+SearchPattern SearchPattern::compile(const std::string &pat,
+                                     bool ignorecase, bool smartcase)
+{
+  SearchPattern sp;
+
+  // Runs of plain characters; the longest one outside any group must be in
+  // every match. Groups may be repeated or made optional, so their contents
+  // can't be relied on.
+  std::string run, best;
+  int depth = 0;
+  bool plain = true;      // Nothing but literal characters so far.
+  bool anyCase = false;   // \c
+  bool exactCase = false; // \C
+  bool upper = false;
+
+  auto end_run = [&] {
+    if (depth == 0 && run.size() > best.size())
+      best = run;
+    run.clear();
+  };
+
+  // A quantifier makes the character before it optional or repeatable.
+  auto quantified = [&](bool optional) {
+    if (optional && !run.empty())
+      run.pop_back();
+    end_run();
+    plain = false;
+  };
+
+  for (size_t i = 0; i < pat.size(); i++) {
+    char c = pat[i];
+    if (std::isupper((unsigned char) c))
+      upper = true;
+
+    if (c == '\\' && i + 1 < pat.size()) {
+      char e = pat[++i];
+      switch (e) {
+        case '\\': case '/': case '.': case '*': case '[': case ']':
+        case '~': case '^': case '$':
+          run += e;
+          break;
+        case 'c': anyCase   = true; break;
+        case 'C': exactCase = true; break;
+        case '+': quantified(false); break;
+        case '=': case '?': quantified(true); break;
+        case '{': {
+          quantified(true);
+          size_t close = pat.find('}', i + 1);
+          i = close != std::string::npos ? close : pat.size();
+          break;
+        }
+        case '(':
+          end_run();
+          depth++;
+          plain = false;
+          break;
+        case '%':
+          // \%( opens a group too. The other \% atoms aren't text; skip
+          // their arguments, like the 123 of \%d123 or the 23l of \%<23l.
+          end_run();
+          plain = false;
+          if (i + 1 >= pat.size())
+            break;
+          if (pat[i + 1] == '(') {
+            depth++;
+            i++;
+          } else if (pat[i + 1] == '[') {
+            // \%[abc] is optional, atom by atom; none of it is required.
+            for (i += 2; i < pat.size() && pat[i] != ']'; i++) {
+              if (pat[i] == '\\') {
+                i++;
+              } else if (pat[i] == '[') {
+                size_t close = pat.find(']', i + 1);
+                i = close != std::string::npos ? close : pat.size();
+              }
+            }
+          } else if (std::strchr("dxouU", pat[i + 1])) {
+            i++;
+            while (i + 1 < pat.size() && std::isxdigit((unsigned char) pat[i + 1]))
+              i++;
+          } else {
+            while (i + 1 < pat.size() && std::strchr("<>", pat[i + 1]))
+              i++;
+            while (i + 1 < pat.size() && std::isdigit((unsigned char) pat[i + 1]))
+              i++;
+            i++;  // l, c, v, #, ^, ' and its mark, ...
+            if (pat[i] == '\'' && i + 1 < pat.size())
+              i++;
+          }
+          break;
+        case ')':
+          end_run();
+          depth = std::max(0, depth - 1);
+          plain = false;
+          break;
+        case '|':
+          // With alternatives, nothing need be in every match.
+          sp.literal.clear();
+          sp.exact = false;
+          sp.icase = !exactCase && ignorecase;
+          return sp;
+        case 'v': case 'V': case 'm': case 'M':
+          // Other magic levels read everything differently; don't guess.
+          sp.icase = ignorecase;
+          return sp;
+        default:
+          end_run();
+          plain = false;
+      }
+      continue;
+    }
+
+    switch (c) {
+      case '*':
+        quantified(true);
+        break;
+      case '[': {
+        end_run();
+        plain = false;
+        size_t close = pat.find(']', i + 1);
+        if (close != std::string::npos)
+          i = close;
+        break;
+      }
+      case '.': case '~': case '^': case '$':
+        end_run();
+        plain = false;
+        break;
+      default:
+        run += c;
+    }
+  }
+  end_run();
+
+  sp.literal = best;
+  sp.exact   = plain;
+  sp.icase   = anyCase || (!exactCase && ignorecase && !(smartcase && upper));
+  return sp;
+}
+
+std::vector<size_t> search_lines(LineCache &cache, const SearchPattern &p,
+                                 size_t start, size_t end, unsigned threads)
+{
+  std::vector<size_t> found;
+  WorkerPool &pool = WorkerPool::shared();
+  if (threads == 0)
+    threads = pool.size() + 1;  // The caller helps too.
+
+  cache.scan(start, end, [&](const std::vector<LineCache::PageRef> &pages) {
+    // Thread t takes every threads-th page; keeping each page's lines apart
+    // lets them be put back in order afterwards.
+    std::vector<std::vector<size_t>> hits(pages.size());
+
+    std::vector<WorkerPool::Job> jobs;
+    for (unsigned t = 0; t < threads && t < pages.size(); t++) {
+      jobs.push_back([&, t] {
+        for (size_t k = t; k < pages.size(); k += threads) {
+          const LineCache::PageRef &page = pages[k];
+          for (size_t j = 0; j < page.lines->size(); j++) {
+            size_t i = page.first + j;
+            if (i < start || i >= end)
+              continue;
+            const std::string &l = (*page.lines)[j];
+            if (find_literal(l.data(), l.size(), p.literal, p.icase) != npos)
+              hits[k].push_back(i);
+          }
+        }
+      });
+    }
+
+    pool.run(jobs);
+
+    for (const std::vector<size_t> &h : hits)
+      found.insert(std::end(found), std::begin(h), std::end(h));
+  });
+
+  return found;
+}
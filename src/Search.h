@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "LineCache.h"
+
+/// A vim search pattern, boiled down to what can be looked for locally.
+///
+/// `literal` is text every match must contain. If `exact`, the pattern is
+/// nothing but that text, and finding it is the same as matching. Otherwise
+/// finding it only says a line might match (an empty literal says nothing),
+/// and nvim has the final word.
+struct SearchPattern
+{
+  std::string literal;
+  bool icase = false;   ///< ASCII letters match either case.
+  bool exact = false;
+
+  /// Reads a pattern as vim would with 'magic' set. `ignorecase` and
+  /// `smartcase` are the options of the same names; \c and \C override them.
+  static SearchPattern compile(const std::string &pattern,
+                               bool ignorecase=false, bool smartcase=false);
+};
+
+/// Finds `needle` in [hay, hay+n), from the left.
+/// @returns its offset, or -1 (as size_t) if it isn't there.
+///
+/// Candidates are found 16 or 32 positions at a time by comparing the
+/// needle's first and last bytes at once (SSE2 or AVX2, picked at runtime),
+/// and only those are compared in full.
+size_t find_literal(const char *hay, size_t n,
+                    const std::string &needle, bool icase=false);
+
+/// The same, without SIMD, for comparison.
+size_t find_literal_scalar(const char *hay, size_t n,
+                           const std::string &needle, bool icase=false);
+
+/// Every occurrence of `p.literal` in `line` that doesn't overlap an earlier
+/// one, as [first, second) byte ranges.
+std::vector<std::pair<size_t,size_t>> find_all(const std::string &line,
+                                               const SearchPattern &p);
+
+/// The lines in [start, end) that contain `p.literal`, in order, which for
+/// an exact pattern means the lines that match. Pages of the cache are
+/// split into `threads` jobs for WorkerPool::shared(); by default, one per
+/// thread in it and one for the caller.
+std::vector<size_t> search_lines(LineCache &, const SearchPattern &p,
+                                 size_t start=0, size_t end=-1,
+                                 unsigned threads=0);
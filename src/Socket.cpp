@@ -1,23 +1,114 @@
 
 #include "Socket.h"
 
+#include <algorithm>
+
 #include <unistd.h>  // for close
+#include <fcntl.h>
+#include <netdb.h>   // getaddrinfo()
+#include <netinet/in.h>
+#include <netinet/tcp.h>  // TCP_NODELAY
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
 #include <sys/un.h>  // unix sockaddr type.
+#include <sys/wait.h>
+#include <climits>   // IOV_MAX
+#include <cerrno>
+#include <cstring>
 
-UnixSocket::UnixSocket() 
+int Transport::send(const char *buf, size_t len)
+{
+  iovec iov = {(void *) buf, len};
+  return write_some(&iov, 1);
+}
+
+int Transport::send(const msgpack::sbuffer& b)
+{
+  return send(b.data(), b.size());
+}
+
+bool Transport::send_all(iovec *iov, int n)
+{
+  while (n > 0) {
+    ssize_t sent = write_some(iov, std::min(n, IOV_MAX));
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+
+    // Skip what was written; a short write may leave us mid-vector.
+    while (n > 0 && (size_t) sent >= iov->iov_len) {
+      sent -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *) iov->iov_base + sent;
+      iov->iov_len -= sent;
+    }
+  }
+  return true;
+}
+
+// nvim can give extreme amounts of data in one burst. Be prepared.
+constexpr size_t MAX_SIZE = 2*1024*1024;
+
+// TODO: This is really inefficient when writing to a msgpack::unpacker.
+std::string Transport::recv()
+{
+  std::string buf(MAX_SIZE, '\0');
+  ssize_t len = read_some(&buf[0], MAX_SIZE);
+  buf.resize(std::max<ssize_t>(len, 0));
+  return buf;
+}
+
+int Transport::recv(msgpack::unpacker& up)
+{
+  up.reserve_buffer(MAX_SIZE);
+  ssize_t len;
+  do
+    len = read_some(up.buffer(), MAX_SIZE);
+  while (len < 0 && errno == EINTR);
+  if (len <= 0)
+    return 0;
+  up.buffer_consumed(len);
+  return len;
+}
+
+FdTransport::~FdTransport()
+{
+  if (out >= 0 && out != in)
+    close(out);
+  if (in >= 0)
+    close(in);
+}
+
+ssize_t FdTransport::read_some(char *buf, size_t len)
 {
-  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  return ::read(in, buf, len);
 }
 
-UnixSocket::~UnixSocket()
+ssize_t FdTransport::write_some(const iovec *iov, int n)
 {
-  close(fd);
+  return ::writev(out, iov, n);
+}
+
+FdTransport::operator bool() const
+{
+  return in >= 0 && out >= 0;
+}
+
+UnixSocket::UnixSocket() 
+{
+  in = out = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
 }
 
 template<typename Addr>
 bool UnixSocket::connect_addr(const Addr& addr)
 {
-  return connect(fd, (sockaddr*)&addr, sizeof(addr)) >= 0;
+  return connect(in, (sockaddr*)&addr, sizeof(addr)) >= 0;
 }
 
 template<typename POD>
@@ -32,42 +123,350 @@ bool UnixSocket::connect_local(const char *path)
   sockaddr_un addr;
   zero(addr);
   addr.sun_family = AF_UNIX;
-  strcpy(addr.sun_path, path);
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
   return connect_addr(addr);
 }
 
-int UnixSocket::send(const char *buf, size_t len)
+ChildProcess::ChildProcess(const std::vector<std::string> &argv)
 {
-  return ::send(fd, (void*)buf, len, 0);
+  // toChild and fromChild carry the conversation. If exec() fails, the
+  // child reports errno on `status`; if it succeeds, `status` just closes.
+  int toChild[2], fromChild[2], status[2];
+  if (pipe2(toChild, O_CLOEXEC) < 0)
+    return;
+  if (pipe2(fromChild, O_CLOEXEC) < 0) {
+    close(toChild[0]), close(toChild[1]);
+    return;
+  }
+  if (pipe2(status, O_CLOEXEC) < 0) {
+    close(toChild[0]), close(toChild[1]);
+    close(fromChild[0]), close(fromChild[1]);
+    return;
+  }
+
+  std::vector<char *> args;
+  for (const std::string &a : argv)
+    args.push_back(const_cast<char *>(a.c_str()));
+  args.push_back(nullptr);
+
+  pid = fork();
+  if (pid == 0) {
+    dup2(toChild[0], STDIN_FILENO);
+    dup2(fromChild[1], STDOUT_FILENO);
+    execvp(args[0], args.data());
+    int e = errno;
+    ssize_t ignored = write(status[1], &e, sizeof e);
+    (void) ignored;
+    _exit(127);
+  }
+
+  close(toChild[0]);
+  close(fromChild[1]);
+  close(status[1]);
+
+  int e = 0;
+  ssize_t n = -1;
+  if (pid > 0) {
+    do
+      n = read(status[0], &e, sizeof e);
+    while (n < 0 && errno == EINTR);
+  }
+  close(status[0]);
+
+  if (pid < 0 || n > 0) {
+    close(toChild[1]);
+    close(fromChild[0]);
+    if (pid > 0)
+      waitpid(pid, nullptr, 0);
+    pid = -1;
+    errno = n > 0 ? e : errno;
+    return;
+  }
+
+  // A child that quits shouldn't take us with it when we next write.
+  signal(SIGPIPE, SIG_IGN);
+  in  = fromChild[0];
+  out = toChild[1];
 }
 
-int UnixSocket::send(const msgpack::sbuffer& b)
+ChildProcess::~ChildProcess()
 {
-  return send(b.data(), b.size());
+  if (pid <= 0)
+    return;
+
+  close(out);
+  out = -1;
+  waitpid(pid, nullptr, 0);
 }
 
-// nvim can give extreme amounts of data in one burst. Be prepared.
-constexpr size_t MAX_SIZE = 2*1024*1024;
+namespace {
+  /// One of the addresses connect_any() is trying.
+  struct Candidate
+  {
+    bool tcp = false;
+    std::string path;           ///< Of a unix socket...
+    std::string dir, name;      ///< ...split for matching inotify events.
+    int watch = -1;             ///< The inotify watch on `watched`...
+    std::string watched;        ///< ...which is `dir`, or the nearest of
+                                ///< its parents that exists yet.
+    bool refused = false;       ///< Whether it's there but not listening,
+                                ///< so it's tried again at `retry`.
+    std::string host, port;     ///< Of a TCP address.
+    std::vector<int> fds;       ///< Its connects in progress, one per
+                                ///< address the host resolved to.
+    std::chrono::steady_clock::time_point retry;
+  };
+}
 
-// TODO: This is really inefficient when writing to a msgpack::unpacker.
-std::string UnixSocket::recv()
+/// The directory `path` is in.
+static std::string parent_of(const std::string &path)
 {
-  char buf[MAX_SIZE];
-  size_t len = ::recv(fd, buf, MAX_SIZE, 0);
-  return std::string(buf, buf+len);
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? "." : slash == 0 ? "/"
+                                          : path.substr(0, slash);
 }
 
-int UnixSocket::recv(msgpack::unpacker& up)
+/// Watches `c.dir` for its socket being created, or, if the directory
+/// isn't there yet either, the nearest parent that is, for that being made.
+static void watch_nearest(int ino, Candidate &c)
 {
-  up.reserve_buffer(MAX_SIZE);
-  size_t len = ::recv(fd, up.buffer(), MAX_SIZE, 0);
-  up.buffer_consumed(len);
-  return len;
+  std::string dir = c.dir;
+  while ((c.watch = inotify_add_watch(ino, dir.c_str(),
+                                      IN_CREATE | IN_MOVED_TO)) < 0
+         && errno == ENOENT && dir != "/" && dir != ".")
+    dir = parent_of(dir);
+  c.watched = dir;
+}
+
+/// Connects to a unix socket right away.
+/// @returns the connected socket, or -1.
+static int connect_unix(const std::string &path)
+{
+  int fd = -1, err;
+  {
+    UnixSocket s;
+    if (s && s.connect_local(path.c_str())) {
+      fd = s.in;
+      s.in = s.out = -1;  // Keep it open past `s`.
+    }
+    err = errno;
+  }
+  errno = err;  // Closing `s` mustn't hide why it failed.
+  return fd;
+}
+
+/// Starts a non-blocking connect to every address a TCP host resolves to,
+/// since "localhost" may give ::1 first while nvim listens on 127.0.0.1.
+/// Those still going are added to `c.fds`.
+/// @returns a socket that connected already, or -1.
+static int start_tcp(Candidate &c)
+{
+  addrinfo hints, *found;
+  zero(hints);
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(c.host.c_str(), c.port.c_str(), &hints, &found) != 0)
+    return -1;
+
+  int done = -1;
+  for (addrinfo *a = found; a && done < 0; a = a->ai_next) {
+    int fd = socket(a->ai_family,
+                    a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    a->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+      done = fd;
+    else if (errno == EINPROGRESS)
+      c.fds.push_back(fd);
+    else
+      close(fd);
+  }
+  freeaddrinfo(found);
+  return done;
 }
 
-UnixSocket::operator bool()
+std::unique_ptr<Transport> connect_any(const std::vector<std::string> &addrs,
+                                       std::chrono::steady_clock::time_point
+                                         deadline,
+                                       size_t *which)
 {
-  return fd >= 0;
+  using Clock = std::chrono::steady_clock;
+  const auto retryEvery = std::chrono::milliseconds(100);
+
+  // A TCP connect under way may finish a little past the deadline, so that
+  // a deadline of now still gives it the chance.
+  const Clock::time_point graceEnd = std::max(
+      deadline, Clock::now() + std::chrono::milliseconds(1000));
+
+  // Watch the directories before the first attempt, so that a socket made
+  // in between can't go unnoticed.
+  int ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+  std::vector<Candidate> cands(addrs.size());
+  for (size_t i = 0; i < addrs.size(); i++) {
+    Candidate &c = cands[i];
+    const std::string &a = addrs[i];
+    size_t colon = a.rfind(':');
+    if (a.find('/') == std::string::npos && colon != std::string::npos) {
+      c.tcp  = true;
+      c.host = a.substr(0, colon);
+      c.port = a.substr(colon + 1);
+      continue;
+    }
+
+    size_t slash = a.rfind('/');
+    c.path = a;
+    c.dir  = parent_of(a);
+    c.name = a.substr(slash == std::string::npos ? 0 : slash + 1);
+    if (ino >= 0)
+      watch_nearest(ino, c);
+  }
+
+  // A unix socket that's missing is left to inotify, but one that refuses
+  // (bound, but nvim isn't listening yet) won't make another event, so it's
+  // tried again every so often like TCP.
+  auto try_unix = [&](Candidate &c) {
+    int fd = connect_unix(c.path);
+    c.refused = fd < 0 && (errno != ENOENT || c.watch < 0);
+    if (c.refused)
+      c.retry = Clock::now() + retryEvery;
+    return fd;
+  };
+
+  int winner = -1;
+  size_t won = 0;
+  auto cleanup = [&] {
+    for (Candidate &c : cands)
+      for (int fd : c.fds)
+        if (fd != winner)
+          close(fd);
+    if (ino >= 0)
+      close(ino);
+  };
+
+  // Everything at once; the earliest address that answers wins.
+  for (size_t i = 0; i < cands.size() && winner < 0; i++) {
+    Candidate &c = cands[i];
+    winner = c.tcp ? start_tcp(c) : try_unix(c);
+    if (c.tcp && winner < 0 && c.fds.empty())
+      c.retry = Clock::now() + retryEvery;
+    won = i;
+  }
+
+  std::vector<pollfd> fds;
+  std::vector<size_t> pending;  // The candidate behind each of fds[1...].
+  while (winner < 0) {
+    Clock::time_point now = Clock::now();
+    Clock::time_point wake = deadline;
+    fds.assign(1, {ino, POLLIN, 0});
+    pending.clear();
+    for (size_t i = 0; i < cands.size(); i++) {
+      Candidate &c = cands[i];
+      if (c.refused && now < deadline)
+        wake = std::min(wake, c.retry);
+      if (!c.tcp)
+        continue;
+      for (int fd : c.fds) {
+        fds.push_back({fd, POLLOUT, 0});
+        pending.push_back(i);
+      }
+      if (c.fds.empty() && now < deadline)
+        wake = std::min(wake, c.retry);
+    }
+
+    Clock::time_point end = pending.empty() ? deadline : graceEnd;
+    if (now >= end)
+      break;
+    if (now >= deadline)
+      wake = end;
+
+    // A retry may have come due while getaddrinfo() blocked; a negative
+    // timeout would wait forever.
+    long ms = std::max<long>(0, std::chrono::duration_cast<
+        std::chrono::milliseconds>(wake - now).count() + 1);
+    if (poll(fds.data(), fds.size(), ms) < 0 && errno != EINTR)
+      break;
+
+    // Something appeared in a directory we watch: one of our sockets, or a
+    // directory on the way to one.
+    if (fds[0].revents & POLLIN) {
+      alignas(inotify_event) char buf[4096];
+      ssize_t n;
+      while (winner < 0 && (n = read(ino, buf, sizeof buf)) > 0) {
+        for (char *p = buf; p < buf + n && winner < 0; ) {
+          const inotify_event *ev = reinterpret_cast<inotify_event *>(p);
+          p += sizeof(inotify_event) + ev->len;
+          for (size_t i = 0; i < cands.size() && winner < 0; i++) {
+            Candidate &c = cands[i];
+            if (c.tcp || c.watch != ev->wd || !ev->len)
+              continue;
+            if (c.watched != c.dir) {
+              // Its socket may have been made along with the directory.
+              watch_nearest(ino, c);
+              if (c.watched == c.dir) {
+                winner = try_unix(c);
+                won = i;
+              }
+            } else if (c.name == ev->name) {
+              winner = try_unix(c);
+              won = i;
+            }
+          }
+        }
+      }
+    }
+
+    for (size_t k = 0; k < pending.size() && winner < 0; k++) {
+      if (!fds[k + 1].revents)
+        continue;
+      Candidate &c = cands[pending[k]];
+      int fd = fds[k + 1].fd;
+      int err = 0;
+      socklen_t len = sizeof err;
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err == 0) {
+        winner = fd;
+        won = pending[k];
+      } else {
+        // Once every address has refused, start over in a while.
+        close(fd);
+        c.fds.erase(std::find(std::begin(c.fds), std::end(c.fds), fd));
+        if (c.fds.empty())
+          c.retry = Clock::now() + retryEvery;
+      }
+    }
+
+    now = Clock::now();
+    for (size_t i = 0; i < cands.size() && winner < 0; i++) {
+      Candidate &c = cands[i];
+      if (c.refused && c.retry <= now && now < deadline) {
+        winner = try_unix(c);
+        won = i;
+      } else if (c.tcp && c.fds.empty() && c.retry <= now
+                 && now < deadline) {
+        winner = start_tcp(c);
+        won = i;
+        if (winner < 0 && c.fds.empty())
+          c.retry = now + retryEvery;
+      }
+    }
+  }
+
+  cleanup();
+  if (winner < 0)
+    return nullptr;
+
+  // Back to blocking, which is what the listener expects.
+  fcntl(winner, F_SETFL, fcntl(winner, F_GETFL) & ~O_NONBLOCK);
+  if (cands[won].tcp) {
+    // Requests are small and latency matters more than packet count.
+    int one = 1;
+    setsockopt(winner, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  }
+  if (which)
+    *which = won;
+  return std::unique_ptr<Transport>(new FdTransport(winner, winner));
 }
 
 std::string socket_error_msg()
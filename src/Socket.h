@@ -1,15 +1,67 @@
 
 #pragma once
 
+#include <chrono>
+#include <memory>
 #include <string>
+#include <vector>
+#include <sys/types.h>  // pid_t, ssize_t
+#include <sys/uio.h>    // iovec
 #include <msgpack.hpp>
 
-struct UnixSocket
+/// A byte stream to nvim, whatever it runs over.
+///
+/// Implementations only provide read_some() and write_some(); everything
+/// else, like looping over short writes, is done here once.
+struct Transport
 {
-  int fd;
+  virtual ~Transport() = default;
 
+  /// Reads what's available, waiting until something is.
+  /// @returns the number of bytes read, zero at EOF, or -1 on error.
+  virtual ssize_t read_some(char *buf, size_t len) = 0;
+
+  /// Writes as much of `iov` as it can at once, like writev().
+  /// @returns the number of bytes written, or -1 on error.
+  virtual ssize_t write_some(const iovec *iov, int n) = 0;
+
+  /// Whether it's usable.
+  virtual explicit operator bool() const = 0;
+
+  int send(const char *buf, size_t len);
+  int send(const msgpack::sbuffer&);
+
+  /// Writes all of `iov`, however many calls that takes.
+  /// Consumes `iov` as it goes.
+  /// @returns false on error, with errno set.
+  bool send_all(iovec *iov, int n);
+
+  std::string recv();
+
+  /// Reads what's available into `up`.
+  /// @returns the number of bytes read, or zero at EOF or on error.
+  int recv(msgpack::unpacker&);
+};
+
+/// A Transport over file descriptors: one to read, and one to write, which
+/// may be the same.
+struct FdTransport : Transport
+{
+  int in  = -1;
+  int out = -1;
+
+  FdTransport() = default;
+  FdTransport(int in, int out) : in(in), out(out) {}
+  ~FdTransport();
+
+  ssize_t read_some(char *buf, size_t len) override;
+  ssize_t write_some(const iovec *iov, int n) override;
+  explicit operator bool() const override;
+};
+
+struct UnixSocket : FdTransport
+{
   UnixSocket();
-  ~UnixSocket();
 
   /// Connects to an arbitrary sockaddr type.
   template<typename Addr>
@@ -17,16 +69,37 @@ struct UnixSocket
 
   /// Connects to `path` using a unix address.
   bool connect_local(const char *path);
+};
 
-  int send(const char *buf, size_t len);
-  int send(const msgpack::sbuffer&);
-
-  std::string recv();
-  int recv(msgpack::unpacker&);
+/// A child process, talked to over its stdin and stdout, as with
+/// `nvim --embed`. Closing its stdin tells it to quit; the destructor does
+/// so and reaps it.
+struct ChildProcess : FdTransport
+{
+  pid_t pid = -1;
 
-  operator bool();
+  /// Runs `argv[0]` from $PATH; check the result with operator bool.
+  explicit ChildProcess(const std::vector<std::string> &argv);
+  ~ChildProcess();
 };
 
+/// Connects to whichever of `addrs` answers first. Each is a unix socket
+/// path, or host:port for TCP.
+///
+/// All of them are tried at once. Until `deadline`, a unix socket that
+/// isn't there yet is waited for with inotify on its directory (or, if
+/// that's missing too, the nearest parent that isn't), so it is connected
+/// to as soon as it's created; one that refuses is tried again every so
+/// often. A TCP address is tried on every
+/// address its host resolves to at once, and again every so often if they
+/// all refuse.
+/// @returns nullptr if none answered in time; otherwise, if `which` isn't
+///          null, sets it to the index of the one that did.
+std::unique_ptr<Transport> connect_any(const std::vector<std::string> &addrs,
+                                       std::chrono::steady_clock::time_point
+                                         deadline,
+                                       size_t *which=nullptr);
+
 /// Converts errno into a human-readable message.
 std::string socket_error_msg();
 
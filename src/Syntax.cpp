@@ -0,0 +1,338 @@
+#include "Syntax.h"
+
+#include <algorithm>
+#include <cctype>
+
+#include "WorkerPool.h"
+
+static const std::unordered_set<std::string> cKeywords = {
+  "alignas", "alignof", "asm", "break", "case", "catch", "class", "const",
+  "const_cast", "constexpr", "continue", "decltype", "default", "delete",
+  "do", "dynamic_cast", "else", "enum", "explicit", "export", "extern",
+  "false", "final", "for", "friend", "goto", "if", "inline", "mutable",
+  "namespace", "new", "noexcept", "nullptr", "operator", "override",
+  "private", "protected", "public", "register", "reinterpret_cast",
+  "return", "sizeof", "static", "static_assert", "static_cast", "struct",
+  "switch", "template", "this", "throw", "true", "try", "typedef",
+  "typename", "union", "using", "virtual", "volatile", "while"
+};
+
+static const std::unordered_set<std::string> cTypes = {
+  "auto", "bool", "char", "char16_t", "char32_t", "double", "float", "int",
+  "int8_t", "int16_t", "int32_t", "int64_t", "long", "short", "signed",
+  "size_t", "ssize_t", "uint8_t", "uint16_t", "uint32_t", "uint64_t",
+  "unsigned", "void", "wchar_t"
+};
+
+static const std::unordered_set<std::string> pyKeywords = {
+  "and", "as", "assert", "async", "await", "break", "class", "continue",
+  "def", "del", "elif", "else", "except", "False", "finally", "for", "from",
+  "global", "if", "import", "in", "is", "lambda", "None", "nonlocal", "not",
+  "or", "pass", "raise", "return", "True", "try", "while", "with", "yield"
+};
+
+static const std::unordered_set<std::string> shKeywords = {
+  "case", "do", "done", "elif", "else", "esac", "export", "fi", "for",
+  "function", "if", "in", "local", "return", "then", "until", "while"
+};
+
+static Language make_c()
+{
+  Language l;
+  l.lineComment  = "//";
+  l.blockOpen    = "/*";
+  l.blockClose   = "*/";
+  l.preprocessor = true;
+  l.keywords     = cKeywords;
+  l.types        = cTypes;
+  return l;
+}
+
+static Language make_python()
+{
+  Language l;
+  l.lineComment  = "#";
+  l.tripleQuotes = true;
+  l.keywords     = pyKeywords;
+  return l;
+}
+
+static Language make_shell()
+{
+  Language l;
+  l.lineComment = "#";
+  l.keywords    = shKeywords;
+  return l;
+}
+
+const Language *Language::for_file(const std::string &name)
+{
+  static const Language c = make_c(), python = make_python(),
+                        shell = make_shell();
+
+  size_t slash = name.rfind('/');
+  std::string base = name.substr(slash == std::string::npos ? 0 : slash + 1);
+  size_t dot = base.rfind('.');
+  std::string ext = dot == std::string::npos ? "" : base.substr(dot + 1);
+
+  for (const char *e : {"c", "h", "cc", "cpp", "cxx", "hh", "hpp", "hxx"})
+    if (ext == e)
+      return &c;
+  if (ext == "py")
+    return &python;
+  if (ext == "sh" || ext == "bash" || base == ".bashrc" || base == ".profile")
+    return &shell;
+  return nullptr;
+}
+
+/// Scans a string from `i` to its closing quote.
+/// @returns the index after it, or the line's length if the string goes on,
+///          in which case `s` says whether it continues on the next line.
+static size_t end_string(const std::string &line, size_t i, LexState &s)
+{
+  size_t n = line.size();
+  while (i < n) {
+    if (line[i] == '\\') {
+      i += 2;
+    } else if (line[i] != s.quote) {
+      i++;
+    } else if (!s.triple) {
+      s = LexState();
+      return i + 1;
+    } else if (line.compare(i, 3, std::string(3, s.quote)) == 0) {
+      s = LexState();
+      return i + 3;
+    } else {
+      i++;
+    }
+  }
+
+  // Only a triple-quoted string or an escaped newline carries on.
+  if (!s.triple && !(n > 0 && line[n - 1] == '\\'))
+    s = LexState();
+  return n;
+}
+
+static bool is_word(char c)
+{
+  return std::isalnum((unsigned char) c) || c == '_';
+}
+
+std::vector<Run> Language::tokenize(const std::string &line,
+                                    LexState &s) const
+{
+  std::vector<Run> runs;
+  size_t n = line.size();
+  size_t i = 0;
+
+  auto push = [&](size_t a, size_t b, Token t) {
+    if (a >= b)
+      return;
+    if (!runs.empty() && runs.back().end == a && runs.back().token == t)
+      runs.back().end = b;
+    else
+      runs.push_back({(uint32_t) a, (uint32_t) b, t});
+  };
+  auto at = [&](size_t j, const std::string &w) {
+    return !w.empty() && line.compare(j, w.size(), w) == 0;
+  };
+
+  // Finish what the last line left open.
+  if (s.mode == LexState::BlockComment) {
+    size_t e = line.find(blockClose);
+    if (e == std::string::npos) {
+      push(0, n, Token::Comment);
+      return runs;
+    }
+    i = e + blockClose.size();
+    push(0, i, Token::Comment);
+    s = LexState();
+  } else if (s.mode == LexState::String) {
+    i = end_string(line, 0, s);
+    push(0, i, Token::String);
+  }
+
+  if (preprocessor && s.mode == LexState::Normal) {
+    size_t hash = line.find_first_not_of(" \t", i);
+    if (i == 0 && hash != std::string::npos && line[hash] == '#') {
+      i = line.find_first_not_of(" \t", hash + 1);
+      while (i < n && is_word(line[i]))
+        i++;
+      i = std::min(i, n);
+      push(hash, i, Token::Preproc);
+    }
+  }
+
+  while (i < n && s.mode == LexState::Normal) {
+    char c = line[i];
+    size_t a = i;
+
+    if (at(i, lineComment)) {
+      push(i, n, Token::Comment);
+      break;
+    }
+
+    if (at(i, blockOpen)) {
+      size_t e = line.find(blockClose, i + blockOpen.size());
+      if (e == std::string::npos) {
+        push(i, n, Token::Comment);
+        s.mode = LexState::BlockComment;
+        break;
+      }
+      i = e + blockClose.size();
+      push(a, i, Token::Comment);
+      continue;
+    }
+
+    if (quotes.find(c) != std::string::npos) {
+      s.mode   = LexState::String;
+      s.quote  = c;
+      s.triple = tripleQuotes && line.compare(i, 3, std::string(3, c)) == 0;
+      i = end_string(line, i + (s.triple ? 3 : 1), s);
+      push(a, i, Token::String);
+      continue;
+    }
+
+    if (std::isdigit((unsigned char) c)) {
+      while (i < n && (is_word(line[i]) || line[i] == '.'))
+        i++;
+      push(a, i, Token::Number);
+      continue;
+    }
+
+    if (is_word(c)) {
+      while (i < n && is_word(line[i]))
+        i++;
+      std::string word = line.substr(a, i - a);
+      if (keywords.count(word))
+        push(a, i, Token::Keyword);
+      else if (types.count(word))
+        push(a, i, Token::Type);
+      continue;
+    }
+
+    i++;
+  }
+
+  return runs;
+}
+
+Highlighter::Highlighter(const Language &lang) : lang(lang)
+{
+}
+
+void Highlighter::edit(size_t first, size_t removed, size_t added)
+{
+  // Past what was ever tokenized, there's nothing to fix.
+  if (first >= lines.size())
+    return;
+
+  size_t oldEnd = first + removed;
+  lines.erase(std::begin(lines) + first,
+              std::begin(lines) + std::min(oldEnd, lines.size()));
+  lines.insert(std::begin(lines) + first, added, Line());
+
+  // Keep any edit not yet caught up with, shifted to where it is now.
+  if (dirtyEnd > first)
+    dirtyEnd = dirtyEnd >= oldEnd ? dirtyEnd - removed + added : first;
+  dirtyEnd = std::max(dirtyEnd, first + added);
+  dirty    = std::min(dirty, first);
+}
+
+void Highlighter::reset()
+{
+  lines.clear();
+  dirty = dirtyEnd = 0;
+}
+
+const std::vector<Run> *Highlighter::runs(size_t i) const
+{
+  return i < dirty ? &lines[i].runs : nullptr;
+}
+
+size_t Highlighter::update(const LineSource &source, size_t upto)
+{
+  if (dirty >= upto)
+    return 0;
+
+  size_t base  = dirty;
+  size_t known = lines.size();  ///< Lines with a state saved from before.
+  std::vector<std::string> text = source(base, upto);
+  upto = base + text.size();
+  if (lines.size() < upto)
+    lines.resize(upto);
+
+  LexState s = base > 0 ? lines[base - 1].out : LexState();
+  size_t count = 0;
+  bool settled = false;
+
+  auto redo = [&](size_t j) {
+    Line &l = lines[j];
+    l.in   = s;
+    l.runs = lang.tokenize(text[j - base], s);
+    l.out  = s;
+    count++;
+  };
+
+  // Once line j leaves the state the next line was saved with, and the next
+  // line wasn't edited, every line up to `known` is as it was. Then only the
+  // lines never tokenized are left.
+  auto settle = [&](size_t j) {
+    if (j + 1 < dirtyEnd || j + 1 >= known || lines[j + 1].in != s)
+      return j + 1;
+    settled = true;
+    s = lines[known - 1].out;
+    return known;
+  };
+
+  size_t i = base;
+  size_t lead = std::min(upto, std::max(dirtyEnd, base) + leadLines);
+  while (i < lead && !settled) {
+    redo(i);
+    i = settle(i);
+  }
+
+  if (i < upto) {
+    // The state at each chunk's start is only a guess, except the first's.
+    size_t from = i;
+    size_t chunks = (upto - from + chunkLines - 1) / chunkLines;
+    std::vector<std::vector<Line>> guess(chunks);
+    std::vector<WorkerPool::Job> jobs;
+    for (size_t c = 0; c < chunks; c++) {
+      jobs.push_back([&, c] {
+        size_t start = from + c * chunkLines;
+        size_t end   = std::min(upto, start + chunkLines);
+        LexState g = c == 0 ? s : start < known ? lines[start].in : LexState();
+        for (size_t j = start; j < end; j++) {
+          Line l;
+          l.in   = g;
+          l.runs = lang.tokenize(text[j - base], g);
+          l.out  = g;
+          guess[c].push_back(std::move(l));
+        }
+      });
+    }
+    WorkerPool::shared().run(jobs);
+    count += upto - from;
+
+    // A line's guess is right if it started from the right state, and so
+    // is the rest of its chunk.
+    while (i < upto) {
+      Line &g = guess[(i - from) / chunkLines][(i - from) % chunkLines];
+      if (g.in == s) {
+        s = g.out;
+        lines[i] = std::move(g);
+      } else {
+        redo(i);
+      }
+      i = settled ? i + 1 : settle(i);
+    }
+  }
+
+  // Edited lines not reached yet stay marked; once every one of them is
+  // redone, there's no edit left to keep track of.
+  dirty = settled ? std::max(known, upto) : upto;
+  if (dirtyEnd <= dirty)
+    dirtyEnd = 0;
+  return count;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+/// What a piece of text is, as far as colouring it goes.
+enum class Token : uint8_t
+{
+  Plain, Comment, String, Number, Keyword, Type, Preproc
+};
+
+/// Bytes [start, end) of a line are a `token`. Plain text has no runs.
+struct Run
+{
+  uint32_t start, end;
+  Token token;
+};
+
+/// Where the lexer is at a line boundary: inside a block comment, or a
+/// string that goes on to the next line, or neither.
+struct LexState
+{
+  enum Mode : uint8_t { Normal, BlockComment, String } mode = Normal;
+  char quote = 0;       ///< The quote that closes the string.
+  bool triple = false;  ///< Whether it's closed by three of them (Python).
+
+  bool operator== (const LexState &o) const
+  {
+    return mode == o.mode && quote == o.quote && triple == o.triple;
+  }
+  bool operator!= (const LexState &o) const { return !(*this == o); }
+};
+
+/// The few facts about a language the lexer needs.
+struct Language
+{
+  std::string lineComment;              ///< Such as "//" or "#".
+  std::string blockOpen, blockClose;    ///< Such as "/*" and "*/".
+  std::string quotes = "\"'";
+  bool tripleQuotes = false;
+  bool preprocessor = false;            ///< '#' starts a directive.
+  std::unordered_set<std::string> keywords, types;
+
+  /// Guesses the language from a file name.
+  /// @returns nullptr if it's none we know.
+  static const Language *for_file(const std::string &name);
+
+  /// Splits `line` into runs, starting in state `s` and leaving `s` as it is
+  /// at the end of the line.
+  std::vector<Run> tokenize(const std::string &line, LexState &s) const;
+};
+
+/// Syntax highlighting for a buffer, kept up to date incrementally.
+///
+/// The lexer state at the start of every line is saved. After an edit,
+/// lines are re-tokenized from the first one edited only until the state
+/// leaving a line matches the one saved for the next: from there on nothing
+/// can have changed. Usually that is a line or two later.
+///
+/// When it isn't, say because a comment was opened, the rest is split into
+/// chunks that are tokenized at once on a WorkerPool, each starting from the
+/// state saved for its first line as a guess. The chunks are then checked in
+/// order; a chunk that started from the wrong state is redone only until it
+/// agrees with its guess.
+struct Highlighter
+{
+  /// Gets lines [start, end); fewer if the buffer ends first.
+  using LineSource =
+    std::function<std::vector<std::string>(size_t start, size_t end)>;
+
+  const Language &lang;
+
+  size_t leadLines  = 64;     ///< Lines to try one by one before going wide.
+  size_t chunkLines = 512;    ///< Lines per job on the pool.
+
+  explicit Highlighter(const Language &);
+
+  /// Lines [first, first + removed) were replaced by `added` new ones.
+  void edit(size_t first, size_t removed, size_t added);
+
+  /// Forgets everything, as after an edit that can't be pinned down.
+  void reset();
+
+  /// Makes sure lines [0, upto) are tokenized, fetching what's needed.
+  /// @returns the number of lines tokenized.
+  size_t update(const LineSource &, size_t upto);
+
+  /// The runs of line `i`, or nullptr if it isn't tokenized yet.
+  const std::vector<Run> *runs(size_t i) const;
+
+private:
+  struct Line
+  {
+    LexState in, out;
+    bool known = false;       ///< Whether `in` was ever computed.
+    std::vector<Run> runs;
+  };
+
+  std::vector<Line> lines;
+  size_t dirty    = 0;        ///< Lines from here on may be out of date...
+  size_t dirtyEnd = 0;        ///< ...and up to here, were edited; or 0.
+};
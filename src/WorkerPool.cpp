@@ -0,0 +1,88 @@
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <thread>  // std::thread::hardware_concurrency()
+
+#include "ScopedLock.h"
+
+WorkerPool::WorkerPool(unsigned n)
+{
+  if (n == 0)
+    n = std::max(1u, std::thread::hardware_concurrency());
+
+  for (unsigned i = 0; i < n; i++) {
+    pthread_t t;
+    if (pthread_create(&t, nullptr, work_loop, this) == 0)
+      threads.push_back(t);
+  }
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    ScopedLock l(lock);
+    stopping = true;
+    pthread_cond_broadcast(&work);
+  }
+  for (pthread_t t : threads)
+    pthread_join(t, nullptr);
+}
+
+WorkerPool &WorkerPool::shared()
+{
+  static WorkerPool pool;
+  return pool;
+}
+
+void WorkerPool::run(std::vector<Job> &jobs)
+{
+  {
+    ScopedLock l(lock);
+    for (Job &j : jobs)
+      queue.push_back(&j);
+    pthread_cond_broadcast(&work);
+  }
+
+  // Help out rather than sit idle; this also gets the jobs done if the pool
+  // has no threads at all.
+  while (Job *j = take(false)) {
+    (*j)();
+    finished();
+  }
+
+  ScopedLock l(lock);
+  while (!queue.empty() || running > 0)
+    pthread_cond_wait(&idle, &lock);
+}
+
+void *WorkerPool::work_loop(void *p)
+{
+  WorkerPool &pool = *static_cast<WorkerPool *>(p);
+  while (Job *j = pool.take(true)) {
+    (*j)();
+    pool.finished();
+  }
+  return nullptr;
+}
+
+WorkerPool::Job *WorkerPool::take(bool wait)
+{
+  ScopedLock l(lock);
+  while (wait && queue.empty() && !stopping)
+    pthread_cond_wait(&work, &lock);
+  if (queue.empty() || stopping)
+    return nullptr;
+
+  Job *j = queue.front();
+  queue.pop_front();
+  running++;
+  return j;
+}
+
+void WorkerPool::finished()
+{
+  ScopedLock l(lock);
+  running--;
+  if (queue.empty() && running == 0)
+    pthread_cond_broadcast(&idle);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+#include <pthread.h>
+
+/// A fixed set of threads that run jobs handed to them in batches.
+///
+/// Starting threads for every batch costs more than small jobs do, so the
+/// threads are made once and sleep between batches.
+struct WorkerPool
+{
+  using Job = std::function<void()>;
+
+  /// Starts `threads` threads; by default, one per processor.
+  explicit WorkerPool(unsigned threads=0);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool &operator= (const WorkerPool&) = delete;
+
+  /// Runs every job, on the pool and the calling thread, and returns once
+  /// all of them have finished.
+  void run(std::vector<Job> &jobs);
+
+  /// A pool shared by everything in the process.
+  static WorkerPool &shared();
+
+  unsigned size() const { return threads.size(); }
+
+private:
+  std::vector<pthread_t> threads;
+
+  std::deque<Job *> queue;
+  size_t running = 0;     ///< Jobs taken from `queue` but not yet finished.
+  bool stopping = false;
+
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t  work = PTHREAD_COND_INITIALIZER;  ///< Jobs were queued.
+  pthread_cond_t  idle = PTHREAD_COND_INITIALIZER;  ///< A job finished.
+
+  static void *work_loop(void *);
+
+  /// Takes the next job, waiting for one unless `wait` is false.
+  /// @returns nullptr if there is none, or the pool is stopping.
+  Job *take(bool wait);
+  void finished();
+};
@@ -1,7 +1,9 @@
 
 #include <algorithm>
+#include <chrono>
 #include <string>
 #include <map>
+#include <memory>
 #include <list>
 #include <utility>
 #include <tuple>
@@ -9,15 +11,26 @@
 #include <unistd.h>  // fork()
 #include <signal.h>  // kill()/SIGKILL
 #include <pthread.h>
+#include <poll.h>
 
 #include <msgpack.hpp>
 
 #include <stdlib.h>
 #include <curses.h>
 #include <signal.h>
+#include <locale.h>
 
 #include "Socket.h"
 #include "NeoServer.h"
+#include "LineMeasure.h"
+#include "BufferMirror.h"
+#include "Layout.h"
+#include "LineCache.h"
+#include "Grid.h"
+#include "LocalEcho.h"
+#include "Diff.h"
+#include "Search.h"
+#include "Syntax.h"
 
 static void finish(int sig);
 
@@ -86,20 +99,35 @@ struct Buffer : Object
   Buffer(NeoServer&);
   Buffer(NeoServer&, uint64_t);
 
+  /// The line cache shared by every Buffer object for this buffer.
+  LineCache &cache();
+
   size_t length();
 
   std::string name();
   void name(const std::string&);
 
+  /// Gets a line through the cache.
   std::string operator[] (uint64_t);
 
-  /// Gets a slice of the buffer.
+  /// Gets a slice of the buffer through the cache; by default, to the end.
   Lines slice(size_t start, size_t end=-1);
 
-  /// Sets a slice of the buffer.
+  /// Sets a slice of the buffer, streaming big ones in pieces.
   void slice(size_t start, size_t end, const Lines&);
   void slice(size_t start, const Lines&);
 
+  /// Makes the buffer read `desired`, sending only the lines that differ
+  /// from what it holds now.
+  /// @returns the number of hunks sent.
+  size_t sync(const Lines &desired);
+
+  /// The lines (0-based) that match a search pattern, as / would find them.
+  /// Cached lines are scanned locally; only lines that might match a regex
+  /// go to nvim to be checked.
+  std::vector<size_t> search(const std::string &pattern,
+                             bool ignorecase=false, bool smartcase=false);
+
   /// Sets a local variable.
   void var(const std::string&, msgpack::object);
   msgpack::object var(const std::string&);
@@ -108,7 +136,7 @@ struct Buffer : Object
 Tab::Tab(NeoServer& s) : serv(s)
 {
   prefix = "tabpage";
-  serv.grab(serv.request("vim_get_current_tabpage"), id);
+  id = serv.current_handle(prefix);
 }
 
 std::vector<Window> Tab::windows()
@@ -128,7 +156,7 @@ Window Tab::window()
 Window::Window(NeoServer &s) : serv(s)
 {
   prefix = "window";
-  serv.grab(serv.request("vim_get_current_window"), id);
+  id = serv.current_handle(prefix);
 }
 
 Window::Window(NeoServer &s, uint64_t id) : serv(s)
@@ -139,7 +167,7 @@ Window::Window(NeoServer &s, uint64_t id) : serv(s)
 
 Buffer Window::buffer()
 {
-  return Buffer(serv, (uint64_t) demand(serv, *this, "get_buffer"));
+  return Buffer(serv, serv.window_buffer(id));
 }
 
 Pos Window::cursor()
@@ -165,7 +193,7 @@ void Window::position(Pos p)
 Buffer::Buffer(NeoServer& serv) : serv(serv)
 {
   prefix = "buffer";
-  serv.grab(serv.request("vim_get_current_buffer"), id);
+  id = serv.current_handle(prefix);
 }
 
 Buffer::Buffer(NeoServer& serv, uint64_t id) : serv(serv)
@@ -174,9 +202,14 @@ Buffer::Buffer(NeoServer& serv, uint64_t id) : serv(serv)
   prefix = "buffer";
 }
 
+LineCache &Buffer::cache()
+{
+  return LineCache::of(serv, id);
+}
+
 size_t Buffer::length()
 {
-  return demand(serv, *this, "get_length");
+  return cache().length();
 }
 
 std::string Buffer::name()
@@ -191,17 +224,27 @@ void Buffer::name(const std::string &newval)
 
 std::string Buffer::operator[] (uint64_t line)
 {
-  return demand(serv, *this, "get_line", line);
+  return cache()[line];
 }
 
 Lines Buffer::slice(size_t start, size_t end)
 {
-  return demand(serv, *this, "get_slice", start, end, true, false);
+  return cache().slice(start, end);
 }
 
 void Buffer::slice(size_t start, size_t end, const Lines& lines)
 {
-  request(serv, *this, "set_slice", start, end, true, false, lines);
+  // Large uploads go in pieces, each written straight from `lines`, and nvim
+  // can start on one while the next is on its way. They go in the bulk lane,
+  // so keep them small enough that input can slip in between.
+  const size_t chunkBytes = 256 << 10;
+  uint64_t method = serv.method_id("buffer_set_slice");
+
+  for (const Hunk &h : split_slice(start, end, lines, chunkBytes))
+    serv.request_lines(method, lines, h.bStart, h.bEnd,
+                       id, h.aStart, h.aEnd, true, false);
+
+  cache().invalidate();
 }
 
 void Buffer::slice(size_t start, const Lines& lines)
@@ -209,6 +252,84 @@ void Buffer::slice(size_t start, const Lines& lines)
   slice(start, -1, lines);
 }
 
+size_t Buffer::sync(const Lines &desired)
+{
+  // The hunks' line numbers must be those of the buffer as it is now, not as
+  // the cache last saw it.
+  cache().validate();
+  Lines current = slice(0);
+  std::vector<Hunk> hunks = diff_lines(current, desired);
+  if (hunks.empty())
+    return 0;
+
+  // Going from the bottom up, each hunk's line numbers are still those of
+  // `current`, so they can all be sent without waiting for replies.
+  uint64_t method = serv.method_id("buffer_set_slice");
+  for (auto it = hunks.rbegin(); it != hunks.rend(); it++) {
+    Hunk h = *it;
+
+    // nvim can't insert after the last line, only before it; so instead,
+    // replace the last line with itself and what follows.
+    if (h.aStart == h.aEnd && h.aStart == current.size() && h.aStart > 0) {
+      h.aStart--;
+      h.bStart--;
+    }
+
+    serv.request_lines(method, desired, h.bStart, h.bEnd,
+                       id, h.aStart, h.aEnd, true, false);
+  }
+
+  cache().invalidate();
+  return hunks.size();
+}
+
+/// `s` as a vimscript string literal.
+static std::string vim_string(const std::string &s)
+{
+  std::string q = "'";
+  for (char c : s)
+    q += c == '\'' ? std::string("''") : std::string(1, c);
+  return q + "'";
+}
+
+/// `p` with its case fixed, so match() treats it as a search would.
+static std::string search_regex(const std::string &p, const SearchPattern &sp)
+{
+  return vim_string((sp.icase ? "\\c" : "\\C") + p);
+}
+
+std::vector<size_t> Buffer::search(const std::string &pattern,
+                                   bool ignorecase, bool smartcase)
+{
+  SearchPattern sp = SearchPattern::compile(pattern, ignorecase, smartcase);
+  std::vector<size_t> found = search_lines(cache(), sp);
+  if (sp.exact || found.empty())
+    return found;
+
+  // Ask about the candidates a batch at a time, so no one eval gets huge.
+  std::string re = search_regex(pattern, sp);
+  std::string buf = std::to_string(id);
+  std::vector<uint64_t> ids;
+  const size_t batch = 4096;
+  for (size_t i = 0; i < found.size(); i += batch) {
+    std::string list;
+    for (size_t j = i; j < std::min(i + batch, found.size()); j++)
+      list += (list.empty() ? "" : ",") + std::to_string(found[j] + 1);
+    ids.push_back(serv.request("vim_eval",
+        "filter([" + list + "], 'match(getbufline(" + buf + ", v:val)[0], '"
+        "." + vim_string(re) + ".') >= 0')"));
+  }
+
+  std::vector<size_t> matched;
+  for (uint64_t r : ids) {
+    std::vector<size_t> lines;
+    serv.grab(r, lines);
+    for (size_t l : lines)
+      matched.push_back(l - 1);
+  }
+  return matched;
+}
+
 void Buffer::var(const std::string& name, msgpack::object o)
 {
   request(serv, *this, "set_var", "b:" + name, o);
@@ -235,6 +356,7 @@ struct TermWindow
   WINDOW *win;
   Pos start, dims;
 
+  TermWindow *parent = nullptr;
   std::vector<TermWindow *> children;
 
   TermWindow();  ///< A fullscreen window.
@@ -264,18 +386,35 @@ TermWindow::TermWindow()
 TermWindow::TermWindow(Pos start, Pos dims) : start(start), dims(dims)
 {
   win = newwin(gety(dims),  getx(dims), gety(start), getx(start));
+
+  // newwin() reads a zero as "to the edge of the screen"; keep what it made.
+  if (win)
+    getmaxyx(win, this->dims.first, this->dims.second);
 }
 
 TermWindow::TermWindow(TermWindow& parent, Pos start, Pos dims)
-    : start(start), dims(dims)
+    : start(start), dims(dims), parent(&parent)
 {
-  win = derwin(parent.win, gety(dims),  getx(dims), gety(start), getx(start));
+  // An empty window, or one that doesn't fit, can't be made; it's left
+  // without a WINDOW and draws nothing.
+  win = nullptr;
+  if (gety(dims) > 0 && getx(dims) > 0)
+    win = derwin(parent.win, gety(dims), getx(dims),
+                 gety(start), getx(start));
+  if (!win)
+    this->dims = {0, 0};
   parent.children.push_back(this);
 }
 
 TermWindow::~TermWindow()
 {
-  delwin(win);
+  if (parent) {
+    auto &siblings = parent->children;
+    siblings.erase(std::remove(std::begin(siblings), std::end(siblings), this),
+                   std::end(siblings));
+  }
+  if (win)
+    delwin(win);
 }
 
 void TermWindow::move(Pos to)
@@ -311,11 +450,570 @@ void TermWindow::qrefresh()
   wnoutrefresh(win);
 }
 
+/// Every attribute cvim draws with, shared by all the frames.
+static Palette palette;
+
+/// The cells of a TermWindow, as they should look after the next flush().
+///
+/// Drawing goes into a Grid, which notes the cells that actually changed;
+/// flush() sends only those spans to curses, so it has little to send to the
+/// terminal when little changed.
+struct Frame
+{
+  TermWindow &tw;
+  Grid grid;
+
+  Frame(TermWindow&);
+
+  /// Sets row `y` to `text`, blanking the rest of the row.
+  void set(int y, const std::string &text, uint16_t attr=0);
+
+  /// Blanks every row from `y` down.
+  void clear_from(int y);
+
+  /// Draws the changed cells into the window.
+  void flush();
+};
+
+Frame::Frame(TermWindow &tw) : tw(tw), grid(gety(tw.dims), getx(tw.dims))
+{
+  // The window starts out blank, and so does the grid.
+  grid.clean();
+}
+
+void Frame::set(int y, const std::string &text, uint16_t attr)
+{
+  if (y < 0 || y >= grid.rows)
+    return;
+
+  int x = grid.put(y, 0, text, attr);
+  grid.fill(y, x, grid.cols - x);
+}
+
+void Frame::clear_from(int y)
+{
+  for (; y < grid.rows; y++)
+    grid.fill(y, 0, grid.cols);
+}
+
+void Frame::flush()
+{
+  if (!tw.win)
+    return;
+
+  std::string run;
+  for (int y = 0; y < grid.rows; y++) {
+    if (!grid.row_dirty(y))
+      continue;
+
+    for (Grid::Span span : grid.dirty_spans(y)) {
+      int x = span.first;
+      if (x > 0 && grid.at(y, x) == 0)
+        x--;  // Start with the first half of a wide character.
+      tw.move({y, x});
+
+      // Send runs of cells that look alike together.
+      while (x < span.second) {
+        uint16_t attr = grid.attr(y, x);
+        run.clear();
+        for (; x < span.second && grid.attr(y, x) == attr; x++)
+          if (char32_t c = grid.at(y, x))
+            append_utf8(run, c);
+
+        const Attr &a = palette[attr];
+        wattrset(tw.win, a.flags | COLOR_PAIR(a.pair));
+        waddstr(tw.win, run.c_str());
+      }
+    }
+  }
+
+  wattrset(tw.win, A_NORMAL);
+  grid.clean();
+}
+
+/// What cvim keeps for each of nvim's windows: where it is on screen, what
+/// was drawn there last, and a mirror of the lines it shows.
+struct WindowView
+{
+  std::unique_ptr<TermWindow>   tw;
+  std::unique_ptr<Frame>        frame;
+  std::unique_ptr<BufferMirror> mirror;
+
+  size_t top = 0;     ///< The buffer line (0-based) at the top of the window.
+  bool stale = true;  ///< Whether the mirror needs an update(window).
+
+  /// Predictions to show on top of the mirror, for the current window.
+  const LocalEcho *echo = nullptr;
+
+  /// Syntax highlighting for the buffer shown, if its language is known.
+  const Highlighter *syntax = nullptr;
+
+  /// The search being typed, whose matches are highlighted.
+  const SearchPattern *search = nullptr;
+
+  /// For a search that isn't plain text, where nvim says it matched on each
+  /// line shown, as byte ranges.
+  std::map<size_t, std::pair<size_t,size_t>> matches;
+
+  WindowView(NeoServer&);
+
+  /// (Re)creates the window inside `parent` at the leaf's position, cut down
+  /// to what fits if nvim's screen is bigger than ours.
+  void place(TermWindow &parent, const Layout &leaf);
+
+  /// Moves `top` just enough to keep the cursor on screen, like vim does.
+  void follow_cursor();
+
+  /// Draws the mirrored lines, with '~' past the end of the buffer.
+  /// Text is coloured by `syntax`, predicted text is underlined until nvim
+  /// confirms it, and matches of `search` are shown in reverse.
+  void draw();
+
+  /// The lines shown that might match `search` but need nvim to say.
+  std::vector<size_t> unsure_lines() const;
+
+  /// Where the cursor goes, relative to `tw`.
+  Pos cursor() const;
+};
+
+WindowView::WindowView(NeoServer &serv)
+  : mirror(new BufferMirror(serv, 0, 0))
+{
+}
+
+void WindowView::place(TermWindow &parent, const Layout &leaf)
+{
+  int y = std::min(std::max(leaf.y, 0), gety(parent.dims));
+  int x = std::min(std::max(leaf.x, 0), getx(parent.dims));
+  int height = std::min(leaf.height, gety(parent.dims) - y);
+  int width  = std::min(leaf.width,  getx(parent.dims) - x);
+
+  frame.reset();
+  tw.reset(new TermWindow(parent, {y, x}, {height, width}));
+  frame.reset(new Frame(*tw));
+
+  // Keep a screenful on either side of the cursor, so any scroll position
+  // that shows it is covered.
+  mirror->above = mirror->below = leaf.height;
+}
+
+void WindowView::follow_cursor()
+{
+  Pos p = echo && echo->active() ? echo->cursor : mirror->cursor;
+  size_t height = gety(tw->dims);
+  size_t line   = p.first > 0 ? p.first - 1 : 0;
+  if (height == 0)
+    return;
+  if (line < top)
+    top = line;
+  else if (line >= top + height)
+    top = line - height + 1;
+}
+
+void WindowView::draw()
+{
+  static const uint16_t guessed = palette.id({A_UNDERLINE, 0});
+  static const uint16_t found   = palette.id({A_REVERSE, 0});
+
+  // Colours as vim's default scheme uses them, by Token.
+  static const uint16_t colors[] = {
+    0,                      // Plain
+    palette.id({0, 4}),     // Comment: blue
+    palette.id({0, 1}),     // String: red
+    palette.id({0, 6}),     // Number: magenta
+    palette.id({0, 3}),     // Keyword: yellow
+    palette.id({0, 2}),     // Type: green
+    palette.id({0, 5}),     // Preproc: cyan
+  };
+
+  int y = 0;
+  for (; y < gety(tw->dims); y++) {
+    size_t i = top + y;
+    const std::string *line = echo ? echo->line(i, *mirror) : mirror->line(i);
+    if (!line) {
+      frame->set(y, i < mirror->length ? "" : "~");
+      continue;
+    }
+
+    int width = getx(tw->dims);
+    frame->set(y, measure_line(*line, width).text);
+
+    // Where each byte is on screen, as far as the window shows.
+    std::vector<int> cols = column_map(*line, width);
+    auto column = [&](size_t b) { return b < cols.size() ? cols[b] : width; };
+
+    const std::vector<Run> *runs = syntax ? syntax->runs(i) : nullptr;
+    for (size_t r = 0; runs && r < runs->size(); r++) {
+      const Run &run = (*runs)[r];
+      int from = column(run.start);
+      if (run.start >= line->size() || from >= width)
+        break;
+      int to = column(std::min<size_t>(run.end, line->size()));
+      frame->grid.paint(y, from, to - from, colors[(int) run.token]);
+    }
+
+    std::vector<std::pair<size_t,size_t>> hits;
+    if (search && search->exact) {
+      hits = find_all(*line, *search);
+    } else if (search) {
+      auto it = matches.find(i);
+      if (it != std::end(matches))
+        hits.push_back(it->second);
+    }
+    for (std::pair<size_t,size_t> h : hits) {
+      int from = column(h.first);
+      if (from >= width)
+        break;
+      int to = column(std::min(h.second, line->size()));
+      frame->grid.paint(y, from, to - from, found);
+    }
+
+    if (echo) {
+      std::pair<size_t,size_t> u = echo->unconfirmed(i, *mirror);
+      if (u.first < u.second && column(u.first) < width) {
+        int from = column(u.first);
+        int to   = column(std::min(u.second, line->size()));
+        frame->grid.paint(y, from, to - from, guessed);
+      }
+    }
+  }
+  frame->flush();
+}
+
+std::vector<size_t> WindowView::unsure_lines() const
+{
+  std::vector<size_t> lines;
+  if (!search || search->exact)
+    return lines;
+
+  for (int y = 0; y < gety(tw->dims); y++) {
+    const std::string *line = mirror->line(top + y);
+    if (line && find_literal(line->data(), line->size(),
+                             search->literal, search->icase) != (size_t) -1)
+      lines.push_back(top + y);
+  }
+  return lines;
+}
+
+Pos WindowView::cursor() const
+{
+  Pos p = echo && echo->active() ? echo->cursor : mirror->cursor;
+  const std::string *line = echo ? echo->line(p.first - 1, *mirror)
+                                 : mirror->line(p.first - 1);
+  int col = line ? display_column(*line, p.second) : p.second;
+  return {(int) (p.first - 1 - top), col};
+}
+
+/// A Highlighter for one buffer, and what it needs to follow the buffer's
+/// edits without fetching it all again.
+///
+/// nvim only says that a buffer changed, not how; so follow() compares the
+/// lines a mirror held before with what it holds now, and takes the first and
+/// last lines that differ as the edit. An edit the mirror can't see, out of
+/// view, makes it start over.
+struct BufferSyntax
+{
+  std::unique_ptr<Highlighter> hl;  ///< Null if the language is unknown.
+
+  BufferSyntax(NeoServer&, uint64_t buffer);
+
+  /// Catches up with the edits that brought the buffer to `m`.
+  void follow(const BufferMirror &m);
+
+  /// Makes the lines down to `upto` ready to draw.
+  void update(const BufferMirror &m, size_t upto);
+
+private:
+  NeoServer &serv;
+  uint64_t buffer;
+
+  // What the mirror last showed us.
+  bool seen = false;
+  uint64_t tick = 0;
+  size_t first = 0, length = 0;
+  BufferMirror::Lines lines;
+};
+
+BufferSyntax::BufferSyntax(NeoServer &serv, uint64_t buffer)
+  : serv(serv), buffer(buffer)
+{
+  bool failed;
+  msgpack::object name = serv.grab(serv.request("buffer_get_name", buffer),
+                                   &failed);
+  if (failed || name.is_nil())
+    return;
+  if (const Language *lang = Language::for_file(name.as<std::string>()))
+    hl.reset(new Highlighter(*lang));
+}
+
+void BufferSyntax::follow(const BufferMirror &m)
+{
+  if (!hl || (seen && m.tick == tick))
+    return;
+
+  if (seen) {
+    // Compare where both copies have lines: from the top for the first line
+    // that differs, and from the bottom, shifted by the change in length,
+    // for the last.
+    long long delta = (long long) m.length - (long long) length;
+    size_t lo  = std::max(first, m.first);
+    size_t hi  = std::min(first + lines.size(), m.first + m.lines.size());
+    size_t pre = lo;
+    while (pre < hi && lines[pre - first] == m.lines[pre - m.first])
+      pre++;
+
+    long long end = std::min<long long>(first + lines.size(),
+                                        m.first + m.lines.size() - delta);
+    while (end > (long long) pre && end + delta > (long long) pre
+           && end - 1 >= (long long) first && end - 1 + delta >= (long long) m.first
+           && lines[end - 1 - first] == m.lines[end - 1 + delta - m.first])
+      end--;
+
+    if (lo >= hi || (pre == hi && delta == 0))
+      hl->reset();
+    else
+      hl->edit(pre, end - pre, end + delta - pre);
+  }
+
+  seen   = true;
+  tick   = m.tick;
+  first  = m.first;
+  length = m.length;
+  lines  = m.lines;
+}
+
+void BufferSyntax::update(const BufferMirror &m, size_t upto)
+{
+  if (!hl)
+    return;
+
+  hl->update([&](size_t start, size_t end) {
+    // The mirror is freshest; anything else comes from the line cache.
+    size_t mEnd = m.first + m.lines.size();
+    end = std::min(end, m.length);
+    if (start >= m.first && end <= mEnd)
+      return BufferMirror::Lines(std::begin(m.lines) + (start - m.first),
+                                 std::begin(m.lines) + (end - m.first));
+
+    BufferMirror::Lines got = LineCache::of(serv, buffer).slice(start, end);
+    for (size_t i = std::max(start, m.first); i < std::min(end, mEnd); i++)
+      if (i - start < got.size())
+        got[i - start] = m.lines[i - m.first];
+    return got;
+  }, upto);
+}
+
+/// cvim's picture of nvim's windows, kept in step with redraw:layout.
+///
+/// A new layout only re-places the windows; their mirrors survive, so a split
+/// or resize doesn't refetch what we already have. Each frame then costs one
+/// round trip for the current window plus two for any other window whose
+/// buffer changed.
+struct LayoutView
+{
+  NeoServer  &serv;
+  TermWindow &area;
+
+  Layout layout;
+  std::vector<uint64_t> order;  ///< Window handles, in winnr() order.
+  std::map<uint64_t, std::unique_ptr<WindowView>> views;
+  uint64_t current = 0;
+
+  /// Typing into the current window, drawn before nvim confirms it.
+  LocalEcho echo;
+
+  /// Syntax highlighting, by buffer.
+  std::map<uint64_t, std::unique_ptr<BufferSyntax>> syntax;
+
+  /// The search being typed, as typed and compiled; empty if there's none.
+  std::string searchText;
+  SearchPattern search;
+
+  /// Until nvim sends a layout, assume one window that fills `area`.
+  LayoutView(NeoServer&, TermWindow &area);
+
+  void apply(Layout);
+
+  /// Brings the windows up to date with nvim and draws them. Without `sync`,
+  /// only redraws what we have, with the latest predictions; that takes no
+  /// round trips at all.
+  void draw(bool sync=true);
+
+  /// Predicts what key `k` will do in the current window.
+  void predict(int k);
+
+private:
+  /// Asks nvim, in one round trip, where the search matches on the lines
+  /// shown that plain text can't decide.
+  void confirm_matches();
+};
+
+LayoutView::LayoutView(NeoServer &serv, TermWindow &area)
+  : serv(serv), area(area)
+{
+  layout.height = gety(area.dims);
+  layout.width  = getx(area.dims);
+  apply(layout);
+}
+
+void LayoutView::apply(Layout l)
+{
+  layout = std::move(l);
+  layout.place(0, 0, layout.count_leaves() > 1 ? 1 : 0);
+
+  std::vector<const Layout *> leaves;
+  layout.leaves(leaves);
+
+  // Everything moves, so start from a blank area; keep what we know about
+  // the windows that are still there.
+  std::map<uint64_t, std::unique_ptr<WindowView>> old;
+  std::swap(old, views);
+  werase(area.win);
+
+  order.clear();
+  for (const Layout *leaf : leaves) {
+    std::unique_ptr<WindowView> &v = views[leaf->window];
+    auto it = old.find(leaf->window);
+    if (it != std::end(old))
+      v = std::move(it->second);
+    else
+      v.reset(new WindowView(serv));
+
+    v->place(area, *leaf);
+    order.push_back(leaf->window);
+  }
+
+  if (!views.count(current))
+    current = order.front();
+}
+
+void LayoutView::predict(int k)
+{
+  echo.key(k, *views[current]->mirror);
+}
+
+void LayoutView::draw(bool sync)
+{
+  if (!sync) {
+    for (auto &kv : views) {
+      kv.second->follow_cursor();
+      kv.second->draw();
+    }
+    return;
+  }
+
+  // Updating the current window also tells us which window that is.
+  WindowView *cur = views[current].get();
+  cur->mirror->update();
+
+  size_t nr = cur->mirror->winnr - 1;
+  if (nr < order.size() && order[nr] != current) {
+    // The focus moved, so what we just fetched belongs to the new window.
+    WindowView *now = views[order[nr]].get();
+    std::swap(cur->mirror, now->mirror);
+    std::swap(cur->mirror->above, now->mirror->above);
+    std::swap(cur->mirror->below, now->mirror->below);
+    cur->stale = true;
+    cur->echo  = nullptr;
+    current = order[nr];
+    cur = now;
+    echo = LocalEcho();
+  }
+  cur->stale = false;
+  cur->echo  = &echo;
+  echo.reconcile(*cur->mirror);
+
+  // Compiling is cheap, and most patterns are plain text that can be found
+  // without asking nvim, so highlights keep up with typing.
+  const BufferMirror &cm = *cur->mirror;
+  if (cm.search != searchText) {
+    searchText = cm.search;
+    search = SearchPattern::compile(searchText, cm.ignorecase, cm.smartcase);
+  }
+
+  for (auto &kv : views) {
+    WindowView &v = *kv.second;
+    BufferMirror &m = *v.mirror;
+
+    // Edits to a buffer show in every window on it.
+    if (m.buffer == cur->mirror->buffer && m.tick != cur->mirror->tick)
+      v.stale = true;
+
+    if (v.stale && kv.first != 0) {
+      m.update(kv.first);
+      v.stale = false;
+    }
+
+    v.search = searchText.empty() ? nullptr : &search;
+    v.follow_cursor();
+
+    if (m.buffer == 0)
+      continue;
+    std::unique_ptr<BufferSyntax> &bs = syntax[m.buffer];
+    if (!bs)
+      bs.reset(new BufferSyntax(serv, m.buffer));
+    bs->follow(m);
+    bs->update(m, v.top + gety(v.tw->dims));
+    v.syntax = bs->hl.get();
+  }
+
+  confirm_matches();
+
+  for (auto &kv : views)
+    kv.second->draw();
+}
+
+void LayoutView::confirm_matches()
+{
+  std::string re = search_regex(searchText, search);
+  std::string expr;
+  std::vector<std::pair<WindowView *, std::vector<size_t>>> asked;
+
+  for (auto &kv : views) {
+    WindowView &v = *kv.second;
+    v.matches.clear();
+    std::vector<size_t> lines = v.unsure_lines();
+    if (lines.empty())
+      continue;
+
+    std::string buf = std::to_string(v.mirror->buffer);
+    for (size_t l : lines) {
+      std::string text = "getbufline(" + buf + ", " + std::to_string(l + 1)
+                         + ")[0]";
+      expr += (expr.empty() ? "[match(" : ", [match(") + text + ", " + re
+              + "), matchend(" + text + ", " + re + ")]";
+    }
+    asked.emplace_back(&v, std::move(lines));
+  }
+  if (asked.empty())
+    return;
+
+  msgpack::object o = serv.grab(serv.request("vim_eval", "[" + expr + "]"));
+  if (o.type != msgpack::type::ARRAY)
+    return;
+
+  std::vector<std::pair<int,int>> found;
+  o.convert(&found);
+
+  size_t k = 0;
+  for (auto &a : asked) {
+    for (size_t l : a.second) {
+      if (k < found.size() && found[k].first >= 0)
+        a.first->matches[l] = {found[k].first, found[k].second};
+      k++;
+    }
+  }
+}
+
 static std::string termkey_to_vimkey(int k);
 
-static void handle_redraw_layout(const msgpack::object &,
-                                 uint64_t window,
-                                 std::vector<std::string>&);
+/// termkey_to_vimkey() of every curses key code, so reading input is just an
+/// index. Filled by build_key_table() once curses is running.
+static std::vector<std::string> keyTable;
+
+static void build_key_table();
+
+static std::vector<std::string> watch_commands(uint64_t chan);
 
 int main(int argc, char *argv[])
 {
@@ -327,11 +1025,14 @@ int main(int argc, char *argv[])
   // Graceful exit for Ctrl-C.
   signal(SIGINT, finish);
 
+  // Needed for wcwidth() and for curses to print UTF-8.
+  setlocale(LC_ALL, "");
+
   initscr();
   keypad(stdscr, TRUE);
   nonl();
   cbreak();
-  echo();
+  noecho();  // Everything on screen comes from nvim.
 
   if (has_colors())
   {
@@ -351,76 +1052,142 @@ int main(int argc, char *argv[])
 
   int consoleY = gety(screenDims) - 10;
   TermWindow bufView({0,0}, screenDims - Pos{10,0});
-  TermWindow console({consoleY, 0}, {10,0});
-
-  //serv.request("vim_subscribe", std::string("redraw:layout"));
-  //serv.request("vim_subscribe", std::string("redraw:cursor"));
+  TermWindow console({consoleY, 0}, {10, getx(screenDims)});
+  keypad(bufView.win, TRUE);
+  build_key_table();
 
-  std::vector<std::string> slice;
+  Frame consoleFrame(console);
 
-  while (true)
-  {
-    // We could request this once, outside the loop, but it causes enough delay
-    // to allow the fallowing functions to work.
-    Data b = current(serv, "buffer");
+  serv.request("vim_subscribe", std::string("redraw:layout"));
+  //serv.request("vim_subscribe", std::string("redraw:cursor"));
 
-    Pos p = serv.grab(current(serv, "window").get("cursor")).convert();
-    size_t startingLine = p.first > 30 ? p.first - 30 - 2 : 0;
+  LayoutView windows(serv, bufView);
+
+  // Metadata that only changes when we're told it did.
+  using std::chrono::seconds;
+  serv.cache_replies("buffer_get_name",
+                     {{"cvim:renamed"}, {"buffer_set_name"}, seconds(5)});
+  serv.cache_replies("window_get_position",
+                     {{"redraw:layout"}, {"window_set_position"}, seconds(5)});
+
+  // Have nvim tell us whenever what we show may have changed, so we know when
+  // to redraw without asking it.
+  for (const std::string &cmd : watch_commands(serv.chan))
+    serv.request("vim_command", cmd);
+
+  auto show = [&] {
+    // Stage every window and write the difference out in one go. The cursor
+    // ends up wherever the last staged window left it.
+    WindowView &cur = *windows.views[windows.current];
+    console.qrefresh();
+    bufView.qrefresh();
+    cur.tw->move(cur.cursor());
+    cur.tw->qrefresh();
+    doupdate();
+  };
 
-    // If we get here too quickly, this'll fetch the previous slice.
-    serv.grab(b.get("slice", startingLine, startingLine + gety(bufView.dims),
-                    true, false),
-              slice);
+  auto draw = [&] {
     int y = 0;
-    for (const auto& line : slice) {
-      if (y >= bufView.dims.first)
-        break;
-      bufView.print({y++, 0}, "%s\n", line.c_str());
-    }
-
-    y = 0;
     for (const auto& note : serv.inquire()) 
     {
-      if (std::get<0>(note) == "redraw:layout") 
+      if (std::get<0>(note) == "cvim:changed")
+      {
+        windows.echo.heard_from_nvim();
+      }
+      else if (std::get<0>(note) == "cvim:renamed")
       {
-        handle_redraw_layout(std::get<1>(note), 
-                             current(serv, "window").id,
-                             slice);
+        // The name picks the language, so start its highlighting over.
+        const msgpack::object &args = std::get<1>(note);
+        if (args.type == msgpack::type::ARRAY && args.via.array.size == 1
+            && args.via.array.ptr[0].type == msgpack::type::POSITIVE_INTEGER)
+          windows.syntax.erase(args.via.array.ptr[0].via.u64);
+      }
+      else if (std::get<0>(note) == "redraw:layout") 
+      {
+        windows.apply(Layout::parse(std::get<1>(note)));
       }
       else  // we don't know how to handle this event.
       {     // Let the user have a look.
-        console.print (
-            {y++,0},
-            "%s : %s", 
-            std::get<0>(note).c_str(),
-            std::to_string(std::get<1>(note)).c_str()
-        );
+        std::string text = std::get<0>(note) + " : "
+                         + std::to_string(std::get<1>(note));
+        consoleFrame.set(y++, measure_line(text, consoleFrame.grid.cols).text);
       }
     }
-  
+    consoleFrame.clear_from(y);
+    consoleFrame.flush();
 
-    move(31, p.second);
+    windows.draw();
     num++;
+    show();
+  };
 
-    bufView.refresh();
-    console.refresh();
+  // However fast events come in, redraw at most this often.
+  using Clock = std::chrono::steady_clock;
+  const auto frameTime = std::chrono::milliseconds(1000 / 60);
+  Clock::time_point lastFrame = Clock::now() - frameTime;
+  bool dirty = true;
+
+  // Sleep until there's a key to read or nvim has something to say.
+  nodelay(bufView.win, TRUE);
+  pollfd fds[] = {
+    { STDIN_FILENO, POLLIN, 0 },
+    { serv.wakefd,  POLLIN, 0 }
+  };
 
-    wclear(bufView.win);
-    wclear(console.win);
+  while (true)
+  {
+    int timeout = -1;
+    if (dirty) {
+      Clock::time_point now = Clock::now();
+      if (now - lastFrame >= frameTime) {
+        draw();
+        lastFrame = now;
+        dirty = false;
+      } else {
+        timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+            frameTime - (now - lastFrame)).count() + 1;
+      }
+    }
 
-    int c = getch();
+    if (poll(fds, 2, timeout) < 0 && errno != EINTR)
+      die_errno("waiting for input with poll()");
 
-    std::string feed = termkey_to_vimkey(c);
-    if (feed != "")
-      serv.request("vim_eval", "feedkeys(\"" + feed + "\")");
+    if (fds[1].revents & POLLIN) {
+      uint64_t n;
+      if (read(serv.wakefd, &n, sizeof n) == sizeof n)
+        dirty = true;
+    }
 
-    // NOTE: uncomment to debug input.
-    //  console.print({0,0},
-    //                "Keycode %i = %c\n\rfeeding %s as '%s'\n",
-    //                c,
-    //                std::isgraph(c) ? (char)c : '?',
-    //                keyname(c),
-    //                feed.c_str());
+    if (fds[0].revents & POLLIN) {
+      // Take everything that's been typed (or pasted) so far and send it as
+      // one request; the next frame will show the result of all of it.
+      std::string keys;
+      int c;
+      while ((c = wgetch(bufView.win)) != ERR) {
+        if (c >= 0 && (size_t) c < keyTable.size()) {
+          keys += keyTable[c];
+          windows.predict(c);
+        }
+
+        // NOTE: uncomment to debug input.
+        //  console.print({0,0},
+        //                "Keycode %i = %c\n\rfeeding %s as '%s'\n",
+        //                c,
+        //                std::isgraph(c) ? (char)c : '?',
+        //                keyname(c),
+        //                keyTable[c].c_str());
+      }
+
+      if (!keys.empty())
+        serv.request("vim_input", keys);
+
+      // Show what we expect right away; nvim will confirm it in a moment.
+      if (windows.echo.active()) {
+        windows.draw(false);
+        show();
+      }
+      dirty = true;
+    }
   }
 
   finish(0);
@@ -431,13 +1198,17 @@ static std::string termkey_to_vimkey(int k)
   if (k == 0)
     return "";
 
-  // TODO: May need special handling for brackets ([]).
-  if (std::isprint(k))
+  // vim_input() reads '<' as the start of a key name.
+  if (k == '<')
+    return "<lt>";
+
+  // Pass on printable characters, including the bytes of UTF-8 sequences.
+  if (k <= 0xff && (std::isprint(k) || k >= 0x80))
     return { (char) k };
 
-  // Feed either '\<word>' or '\<mod-word>'.
+  // Feed either '<word>' or '<mod-word>'.
   auto feed_word = [&](const char *word, const char *mod) {
-      std::string feed = "\\<";
+      std::string feed = "<";
       if (mod) {
         feed += mod;
         feed += "-";
@@ -472,6 +1243,9 @@ static std::string termkey_to_vimkey(int k)
   }
 
   const char *kname = keyname(k);
+  if (!kname)
+    return "";
+
   if (kname[0] == '^') {
     std::string feed = "<C-";
     feed += tolower(kname[1]);
@@ -498,18 +1272,33 @@ static std::string termkey_to_vimkey(int k)
   return "";
 }
 
-static void handle_redraw_layout(const msgpack::object    &o,
-                                 uint64_t                 window,
-                                 std::vector<std::string> &slice)
+static void build_key_table()
 {
-  std::map<std::string, msgpack::object> node = o.convert();
-  if (node["type"] == "leaf") {
-    if (node["window_id"] == window) {
-    }
-  }
+  keyTable.resize(KEY_MAX + 1);
+  for (int k = 0; k <= KEY_MAX; k++)
+    keyTable[k] = termkey_to_vimkey(k);
 }
-      
 
+/// Ex commands that make nvim send "cvim:changed" to `chan` whenever the
+/// cursor, the text or the current window changes, and "cvim:renamed", with
+/// the buffer's number, when a buffer gets a new name.
+///
+/// They go in a group named after the channel, so that another cvim attached
+/// to the same nvim keeps its own.
+static std::vector<std::string> watch_commands(uint64_t chan)
+{
+  std::string ch = std::to_string(chan);
+  return {
+    "augroup cvim" + ch,
+    "autocmd!",
+    "autocmd CursorMoved,CursorMovedI,TextChanged,TextChangedI,"
+    "BufEnter,WinEnter,TabEnter,VimResized * "
+    "call rpcnotify(" + ch + ", 'cvim:changed')",
+    "autocmd BufFilePost * "
+    "call rpcnotify(" + ch + ", 'cvim:renamed', str2nr(expand('<abuf>')))",
+    "augroup END"
+  };
+}
 
 static void finish(int sig)
 {
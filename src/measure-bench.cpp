@@ -0,0 +1,140 @@
+// Times measure_line() and display_column() against their scalar versions.
+//
+//    measure-bench [file...]
+//
+// Lines come from the files given, or else from a few made-up kinds of text:
+// plain code, code indented with tabs, and text with multi-byte characters.
+// Each kind is first checked to come out the same both ways.
+
+#include "LineMeasure.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <locale.h>
+
+using Clock = std::chrono::steady_clock;
+using Lines = std::vector<std::string>;
+
+static Lines made_up(const char *const *pieces, size_t n, size_t count)
+{
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<size_t> pick(0, n - 1);
+  std::uniform_int_distribution<int> length(20, 160);
+
+  Lines lines(count);
+  for (std::string &l : lines) {
+    size_t want = length(rng);
+    while (l.size() < want)
+      l += pieces[pick(rng)];
+  }
+  return lines;
+}
+
+static Lines read_lines(const char *path)
+{
+  Lines lines;
+  std::ifstream in(path);
+  std::string l;
+  while (std::getline(in, l))
+    lines.push_back(l);
+  return lines;
+}
+
+/// Runs `f` over every line until a good fraction of a second has passed.
+/// @returns nanoseconds per line.
+template<typename F>
+static double time_per_line(const Lines &lines, F f)
+{
+  size_t total = 0, rounds = 0;
+  Clock::time_point start = Clock::now(), now;
+  do {
+    for (const std::string &l : lines)
+      total += f(l);
+    rounds++;
+    now = Clock::now();
+  } while (now - start < std::chrono::milliseconds(300));
+
+  // Keep the work from being optimized away.
+  if (total == 1)
+    std::puts("");
+
+  std::chrono::duration<double, std::nano> d = now - start;
+  return d.count() / (rounds * lines.size());
+}
+
+static bool same(const Lines &lines, int width)
+{
+  for (const std::string &l : lines) {
+    MeasuredLine a = measure_line(l, width), b = measure_line_scalar(l, width);
+    if (a.text != b.text || a.cols != b.cols || a.valid != b.valid)
+      return false;
+    if (display_column(l, l.size()) != display_column_scalar(l, l.size()))
+      return false;
+  }
+  return true;
+}
+
+static void bench(const char *name, const Lines &lines, int width)
+{
+  if (lines.empty())
+    return;
+  if (!same(lines, width)) {
+    std::printf("%s: the fast and scalar paths disagree!\n", name);
+    std::exit(1);
+  }
+
+  double fast = time_per_line(lines, [&](const std::string &l) {
+    return measure_line(l, width).cols;
+  });
+  double slow = time_per_line(lines, [&](const std::string &l) {
+    return measure_line_scalar(l, width).cols;
+  });
+  double fastCol = time_per_line(lines, [&](const std::string &l) {
+    return display_column(l, l.size());
+  });
+  double slowCol = time_per_line(lines, [&](const std::string &l) {
+    return display_column_scalar(l, l.size());
+  });
+
+  std::printf("%-8s measure_line   %6.1f ns/line, scalar %6.1f (x%.2f)\n"
+              "%-8s display_column %6.1f ns/line, scalar %6.1f (x%.2f)\n",
+              name, fast, slow, slow / fast,
+              "", fastCol, slowCol, slowCol / fastCol);
+}
+
+int main(int argc, char *argv[])
+{
+  // For wcwidth().
+  setlocale(LC_ALL, "");
+  const int width = 200;
+
+  if (argc > 1) {
+    for (int i = 1; i < argc; i++)
+      bench(argv[i], read_lines(argv[i]), width);
+    return 0;
+  }
+
+  static const char *const code[] = {
+    "int ", "x", " = ", "foo(bar, baz);", " // comment", "return ",
+    "std::string ", "if (a < b) ", "{ ", "}", "0x1f", "  "
+  };
+  static const char *const tabbed[] = {
+    "\t", "\t\t", "int ", "x = y;", " ", "call(a, b)", "\t// note"
+  };
+  static const char *const wide[] = {
+    "caf\xc3\xa9 ", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e", " na\xc3\xafve ",
+    "plain words ", "\xce\xbb ", "\xf0\x9f\x98\x80", "x = 1; "
+  };
+
+  bench("code",   made_up(code,   sizeof code   / sizeof *code,   4096), width);
+  bench("tabbed", made_up(tabbed, sizeof tabbed / sizeof *tabbed, 4096),
+        width);
+  bench("wide",   made_up(wide,   sizeof wide   / sizeof *wide,   4096), width);
+}
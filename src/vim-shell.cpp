@@ -1,10 +1,13 @@
 
 #include "Socket.h"
 #include "NeoServer.h"
+#include "Bench.h"
 
 #include <algorithm>
 #include <string>
 #include <iostream>
+#include <fstream>
+#include <cstdlib>
 #include <map>
 #include <list>
 #include <utility>
@@ -93,13 +96,405 @@ void cout_reply(const NeoServer::Reply& reply)
   std::cout << std::get<1>(reply) << std::endl;
 }
 
-int main()
+/// One line of a script: a method and its arguments, still as words.
+struct Command
 {
+  std::string method;
+  std::vector<std::string> args;
+};
+
+/// If `w` is "$N", referring to the result of the Nth command, returns N.
+/// @returns zero otherwise.
+size_t reference(const std::string& w)
+{
+  if (w.size() < 2 || w[0] != '$')
+    return 0;
+  if (!std::all_of(std::begin(w)+1, std::end(w), ::isdigit))
+    return 0;
+  return std::stoul(w.substr(1));
+}
+
+/// Reads every command in a script up front, so that they can all be sent
+/// before any reply comes back. Blank lines and lines starting with '#' are
+/// skipped, and "quit" ends the script early.
+/// @returns false if any line is malformed; nothing should be sent then.
+bool parse_script(std::istream& in, std::vector<Command>& cmds)
+{
+  bool ok = true;
+  std::string line;
+  for (size_t n = 1; std::getline(in, line); n++) {
+    std::vector<std::string> ws;
+    auto wordsError = words(std::begin(line), 
+                            std::end(line),
+                            std::back_inserter(ws));
+
+    if (wordsError != WordsError::OK) {
+      std::cerr << "line " << n << ": "
+                << (wordsError == WordsError::UNESCAPED_QUOTE
+                    ? "quotation not escaped" : "ends with escape")
+                << std::endl;
+      ok = false;
+      continue;
+    }
+
+    if (ws.empty() || ws[0][0] == '#')
+      continue;
+    if (ws[0] == "quit")
+      break;
+
+    if (!std::isdigit(ws[0][0]) && !server->method_id(ws[0])) {
+      std::cerr << "line " << n << ": unrecognized method name: " << ws[0]
+                << std::endl;
+      ok = false;
+      continue;
+    }
+
+    // A command can only depend on the ones before it.
+    for (const std::string& w : ws) {
+      size_t ref = reference(w);
+      if (&w != &ws[0] && w[0] == '$' && (ref == 0 || ref > cmds.size())) {
+        std::cerr << "line " << n << ": " << w 
+                  << " does not name an earlier command" << std::endl;
+        ok = false;
+      }
+    }
+
+    cmds.push_back({ws[0], {std::begin(ws)+1, std::end(ws)}});
+  }
+
+  return ok;
+}
+
+/// Sends every command back to back and prints the replies in order, as
+/// "[N] => reply" with N counting commands from one. An argument of "$N"
+/// stands for the reply to command N; only when that reply hasn't arrived do
+/// we stop sending to wait for it.
+void run_script(NeoServer& serv, const std::vector<Command>& cmds)
+{
+  std::vector<uint64_t> ids;
+  std::vector<msgpack::object> results(cmds.size());
+  std::vector<bool> have(cmds.size(), false);
+  // Every reply is needed until the end, not just until the next grab().
+  std::vector<std::shared_ptr<void>> owners(cmds.size());
+
+  auto result = [&](size_t i) -> const msgpack::object& {
+    if (!have[i]) {
+      results[i] = serv.grab(ids[i], nullptr, owners[i]);
+      have[i] = true;
+    }
+    return results[i];
+  };
+
+  for (const Command& c : cmds) {
+    std::vector<msgpack::object> args;
+    for (const std::string& w : c.args) {
+      size_t ref = reference(w);
+      args.push_back(ref ? result(ref - 1) : read_object(w));
+    }
+
+    uint64_t id = std::isdigit(c.method[0]) ? std::stoi(c.method)
+                                            : serv.method_id(c.method);
+    ids.push_back(serv.request_with(id, args));
+  }
+
+  for (size_t i = 0; i < cmds.size(); i++)
+    std::cout << '[' << i + 1 << "] => " << result(i) << '\n';
+  std::cout.flush();
+}
+
+/// Appends `o` to `out` in a terse, JSON-like form.
+void append_compact(std::string& out, const msgpack::object& o)
+{
+  switch (o.type) {
+    case msgpack::type::NIL: 
+      out += "nil"; 
+      break;
+    case msgpack::type::BOOLEAN: 
+      out += o.via.boolean ? "true" : "false";
+      break;
+    case msgpack::type::POSITIVE_INTEGER: 
+      out += std::to_string(o.via.u64);
+      break;
+    case msgpack::type::NEGATIVE_INTEGER: 
+      out += std::to_string(o.via.i64);
+      break;
+    case msgpack::type::DOUBLE: 
+      out += std::to_string(o.via.dec);
+      break;
+#if MSGPACK_VERSION_MINOR >= 6
+    case msgpack::type::STR: 
+    case msgpack::type::BIN: {
+      const char *p = o.via.str.ptr;
+      size_t n = o.via.str.size;
+#else
+    case msgpack::type::RAW: {
+      const char *p = o.via.raw.ptr;
+      size_t n = o.via.raw.size;
+#endif
+      out += '"';
+      for (size_t i = 0; i < n; i++) {
+        unsigned char c = p[i];
+        if (c == '"' || c == '\\') {
+          out += '\\';
+          out += c;
+        } else if (c < 0x20) {
+          static const char hex[] = "0123456789abcdef";
+          out += "\\x";
+          out += hex[c >> 4];
+          out += hex[c & 0xf];
+        } else {
+          out += c;
+        }
+      }
+      out += '"';
+      break;
+    }
+    case msgpack::type::ARRAY:
+      out += '[';
+      for (uint32_t i = 0; i < o.via.array.size; i++) {
+        if (i) out += ',';
+        append_compact(out, o.via.array.ptr[i]);
+      }
+      out += ']';
+      break;
+    case msgpack::type::MAP:
+      out += '{';
+      for (uint32_t i = 0; i < o.via.map.size; i++) {
+        if (i) out += ',';
+        append_compact(out, o.via.map.ptr[i].key);
+        out += ':';
+        append_compact(out, o.via.map.ptr[i].val);
+      }
+      out += '}';
+      break;
+    default:
+      out += '?';
+  }
+}
+
+/// Output that the listener thread produces and a writer thread drains, so a
+/// slow terminal never holds up reading from the socket. Whatever piles up
+/// while a write is in progress goes out in the next one.
+struct WatchOutput
+{
+  std::string pending;
+  bool stop = false;
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+
+  static void *write_out(void *p)
+  {
+    WatchOutput& self = *static_cast<WatchOutput*>(p);
+    std::string batch;
+    while (true) {
+      {
+        ScopedLock l(self.lock);
+        while (self.pending.empty() && !self.stop)
+          pthread_cond_wait(&self.ready, &self.lock);
+        if (self.pending.empty())
+          return nullptr;
+        batch.swap(self.pending);
+      }
+      fwrite(batch.data(), 1, batch.size(), stdout);
+      fflush(stdout);
+      batch.clear();
+    }
+  }
+};
+
+/// Streams the named notifications as they arrive, one per line, until the
+/// user hits Enter. Only the events asked for are subscribed to, so nvim
+/// doesn't send the rest at all.
+void watch(NeoServer& serv, const std::vector<std::string>& events)
+{
+  if (events.empty()) {
+    std::cerr << "usage: watch <event...>" << std::endl;
+    return;
+  }
+
+  // Anything printed through std::cout so far must come out first.
+  std::cout.flush();
+
+  std::vector<uint64_t> ids;
+  for (const std::string& e : events)
+    ids.push_back(serv.request("vim_subscribe", e));
+  for (uint64_t id : ids)
+    serv.grab(id);
+
+  WatchOutput out;
+  pthread_t writer;
+  if (pthread_create(&writer, nullptr, WatchOutput::write_out, &out) != 0) {
+    std::cerr << "Can't start the watch writer" << std::endl;
+    return;
+  }
+
+  serv.on_note([&](const std::string& name, const msgpack::object& args) {
+    // Notes sent to our channel directly may be anything; leave those be.
+    if (std::find(std::begin(events), std::end(events), name) 
+        == std::end(events))
+      return false;
+
+    std::string line = name;
+    line += ": ";
+    append_compact(line, args);
+    line += '\n';
+
+    ScopedLock l(out.lock);
+    bool wake = out.pending.empty();
+    out.pending += line;
+    if (wake)
+      pthread_cond_signal(&out.ready);
+    return true;
+  });
+
+  std::string line;
+  std::getline(std::cin, line);
+
+  serv.on_note(nullptr);
+  ids.clear();
+  for (const std::string& e : events)
+    ids.push_back(serv.request("vim_unsubscribe", e));
+  for (uint64_t id : ids)
+    serv.grab(id);
+
+  {
+    ScopedLock l(out.lock);
+    out.stop = true;
+    pthread_cond_signal(&out.ready);
+  }
+  pthread_join(writer, nullptr);
+}
+
+/// Parses a --bench call, "[weight*]method arg...", like a script line.
+/// @returns false if it is malformed.
+bool parse_call(const std::string& spec, BenchCall& call)
+{
+  std::vector<std::string> ws;
+  if (words(std::begin(spec), std::end(spec), std::back_inserter(ws)) 
+      != WordsError::OK || ws.empty())
+    return false;
+
+  std::string& name = ws[0];
+  size_t star = name.find('*');
+  if (star != std::string::npos) {
+    if (star == 0 || !std::all_of(std::begin(name), std::begin(name)+star,
+                                  ::isdigit))
+      return false;
+    call.weight = std::stoul(name.substr(0, star));
+    name.erase(0, star + 1);
+  }
+
+  call.name   = name;
+  call.method = server->method_id(name);
+  call.words.assign(std::begin(ws)+1, std::end(ws));
+  return call.method != 0;
+}
+
+/// The calls a benchmark makes when none are given: every getter that takes
+/// no arguments, since those are safe to run against anyone's editor.
+std::vector<BenchCall> default_mix(const NeoServer& serv)
+{
+  std::vector<BenchCall> mix;
+  for (const NeoFunc& nf : serv.functions()) {
+    if (nf.args.empty() && nf.name.find("_get_") != std::string::npos) {
+      BenchCall c;
+      c.name   = nf.name;
+      c.method = nf.id;
+      mix.push_back(c);
+    }
+  }
+  return mix;
+}
+
+void usage(const char *self)
+{
+  std::cerr << "usage: " << self << " [-f script]\n"
+            << "       " << self << " --bench [-c connections] [-r rate]"
+                                    " [-d seconds] [-m '[weight*]method arg...']..."
+            << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  const char *script = nullptr;
+  bool bench = false;
+  int connections = 4;
+  BenchOptions opts;
+  std::vector<std::string> specs;
+
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    bool more = i + 1 < argc;
+    if (a == "-f" && more)
+      script = argv[++i];
+    else if (a == "--bench")
+      bench = true;
+    else if (a == "-c" && more)
+      connections = std::max(1, std::atoi(argv[++i]));
+    else if (a == "-r" && more)
+      opts.rate = std::atof(argv[++i]);
+    else if (a == "-d" && more)
+      opts.duration = std::chrono::duration<double>(std::atof(argv[++i]));
+    else if (a == "-m" && more)
+      specs.push_back(argv[++i]);
+    else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
   NeoServer serv;
   server = &serv;
 
+  if (bench) {
+    std::vector<BenchCall> mix;
+    for (const std::string& spec : specs) {
+      BenchCall c;
+      if (!parse_call(spec, c)) {
+        std::cerr << "Bad call: " << spec << std::endl;
+        return 2;
+      }
+      mix.push_back(c);
+    }
+    if (mix.empty())
+      mix = default_mix(serv);
+    if (mix.empty()) {
+      std::cerr << "No calls to benchmark; give some with -m." << std::endl;
+      return 2;
+    }
+
+    // The objects refer to the words, so make them only once `mix` is final.
+    for (BenchCall& c : mix)
+      std::transform(std::begin(c.words), std::end(c.words),
+                     std::back_inserter(c.args), read_object);
+
+    std::vector<std::unique_ptr<NeoServer>> conns;
+    for (int i = 0; i < connections; i++)
+      conns.emplace_back(new NeoServer);
+
+    return run_bench(conns, mix, opts, std::cout) ? 0 : 1;
+  }
+
+  // Scripts, given by name or piped in, run without prompts.
+  if (script || !isatty(STDIN_FILENO)) {
+    std::ifstream file;
+    if (script) {
+      file.open(script);
+      if (!file) {
+        std::cerr << "Can't open " << script << std::endl;
+        return 1;
+      }
+    }
+
+    std::vector<Command> cmds;
+    if (!parse_script(script ? file : std::cin, cmds))
+      return 1;
+    run_script(serv, cmds);
+    return 0;
+  }
+
   std::cout << "API:" << std::endl;
-  for (NeoFunc& nf : server->functions)
+  for (const NeoFunc& nf : server->functions())
     std::cout << nf << '\n';
 
   std::vector<uint64_t> waiting;  // Messages actively waiting on.
@@ -163,6 +558,11 @@ int main()
       default: break;  // Ok!
     }
 
+    if (ws[0] == "watch") {
+      watch(serv, {std::begin(ws)+1, std::end(ws)});
+      continue;
+    }
+
     std::vector<msgpack::object> args;
 
     std::transform(std::begin(ws)+1, std::end(ws), 
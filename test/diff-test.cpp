@@ -0,0 +1,80 @@
+// Checks that split_slice() uploads big slices in pieces nvim accepts, and
+// that together they leave the buffer as one call would.
+
+#include "Diff.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using Lines = std::vector<std::string>;
+
+static int failures = 0;
+
+static void expect(bool ok, const char *what)
+{
+  if (!ok) {
+    std::printf("FAIL: %s\n", what);
+    failures++;
+  }
+}
+
+/// Applies `pieces` to `buf` as nvim would buffer_set_slice, replacing
+/// [aStart, aEnd) with lines [bStart, bEnd) of `lines`.
+/// @returns false if nvim would have refused one: it can't insert after the
+///          last line.
+static bool apply(Lines &buf, const std::vector<Hunk> &pieces,
+                  const Lines &lines)
+{
+  for (const Hunk &h : pieces) {
+    if (h.aStart > h.aEnd || h.aEnd > buf.size()
+        || (!buf.empty() && h.aStart >= buf.size()))
+      return false;
+    buf.erase(std::begin(buf) + h.aStart, std::begin(buf) + h.aEnd);
+    buf.insert(std::begin(buf) + h.aStart, std::begin(lines) + h.bStart,
+               std::begin(lines) + h.bEnd);
+  }
+  return true;
+}
+
+static Lines numbered(const char *prefix, size_t n)
+{
+  Lines lines;
+  for (size_t i = 0; i < n; i++)
+    lines.push_back(prefix + std::to_string(i));
+  return lines;
+}
+
+/// Replaces [start, end) of a `size`-line buffer with `n` lines, in pieces
+/// of `chunk` bytes, and checks it comes out as one replacement would.
+static void check(size_t size, size_t start, size_t end, size_t n,
+                  size_t chunk, size_t wantPieces, const char *what)
+{
+  Lines buf = numbered("old ", size), lines = numbered("new ", n);
+  Lines want(std::begin(buf), std::begin(buf) + start);
+  want.insert(std::end(want), std::begin(lines), std::end(lines));
+  want.insert(std::end(want), std::begin(buf) + end, std::end(buf));
+
+  std::vector<Hunk> pieces = split_slice(start, end, lines, chunk);
+  bool ok = apply(buf, pieces, lines);
+  if (!ok || buf != want || pieces.size() != wantPieces) {
+    std::printf("  %zu pieces, %s\n", pieces.size(),
+                ok ? "accepted" : "refused");
+    expect(false, what);
+  }
+}
+
+int main()
+{
+  // Each line is 5 or 6 bytes; 64 bytes takes 11 or 12 of them.
+  check(10,  5, 10, 100, 64, 9, "several pieces up to the end");
+  check(10,  0, 10, 100, 64, 9, "several pieces over everything");
+  check(10,  2,  4, 100, 64, 9, "several pieces in the middle");
+  check(10,  3,  3,  30, 64, 3, "several pieces inserted");
+  check(10,  5, 10,  10, 1 << 20, 1, "one piece when it fits");
+  check(10,  5,  7,   0, 64, 1, "a deletion is one piece");
+
+  if (failures == 0)
+    std::printf("ok\n");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,56 @@
+// Checks what SearchPattern::compile() requires of a line, and that it never
+// requires more than a match has.
+
+#include "Search.h"
+
+#include <cstdio>
+#include <string>
+
+static int failures = 0;
+
+/// Compiles `pattern` and checks its literal and exactness.
+static void expect(const char *pattern, const char *literal, bool exact)
+{
+  SearchPattern sp = SearchPattern::compile(pattern);
+  if (sp.literal != literal || sp.exact != exact) {
+    std::printf("FAIL: %s gave \"%s\"%s, expected \"%s\"%s\n", pattern,
+                sp.literal.c_str(), sp.exact ? " (exact)" : "",
+                literal, exact ? " (exact)" : "");
+    failures++;
+  }
+}
+
+/// Checks that a line vim would match with `pattern` gets past the filter.
+static void passes(const char *pattern, const std::string &line)
+{
+  SearchPattern sp = SearchPattern::compile(pattern);
+  if (find_literal(line.data(), line.size(), sp.literal, sp.icase)
+      == (size_t) -1) {
+    std::printf("FAIL: %s drops \"%s\" (needs \"%s\")\n", pattern,
+                line.c_str(), sp.literal.c_str());
+    failures++;
+  }
+}
+
+int main()
+{
+  expect("hello", "hello", true);
+  expect("foo.*bar", "foo", false);
+  expect("a\\.b", "a.b", true);
+  expect("colou\\=r", "colo", false);
+  expect("\\%(ab\\)cd", "cd", false);
+  expect("\\%d65xyz", "xyz", false);
+  expect("x\\|y", "", false);
+
+  // \%[...] is optional, so none of what it holds is required.
+  expect("fu\\%[nction]", "fu", false);
+  expect("r\\%[ead]me", "me", false);
+  expect("ab\\%[[xy]z]cd", "ab", false);
+  expect("ab\\%[\\]]cdef", "cdef", false);
+  passes("fu\\%[nction]", "fun");
+  passes("r\\%[ead]me", "reme");
+
+  if (failures == 0)
+    std::printf("ok\n");
+  return failures ? 1 : 0;
+}
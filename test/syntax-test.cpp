@@ -0,0 +1,119 @@
+// Checks that Highlighter only re-tokenizes what an edit can have changed,
+// and that what it ends up with matches tokenizing from scratch.
+
+#include "Syntax.h"
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+using Lines = std::vector<std::string>;
+
+static int failures = 0;
+
+static void expect(bool ok, const char *what, size_t got)
+{
+  if (!ok) {
+    std::printf("FAIL: %s (got %zu)\n", what, got);
+    failures++;
+  }
+}
+
+static Highlighter::LineSource source(const Lines &text)
+{
+  return [&text](size_t start, size_t end) {
+    end = std::min(end, text.size());
+    return Lines(std::begin(text) + start, std::begin(text) + end);
+  };
+}
+
+/// Whether `h` has every line of `text` as a fresh Highlighter would.
+static bool same_as_fresh(const Highlighter &h, const Language &lang,
+                          const Lines &text)
+{
+  Highlighter fresh(lang);
+  fresh.update(source(text), text.size());
+  for (size_t i = 0; i < text.size(); i++) {
+    const std::vector<Run> *a = h.runs(i), *b = fresh.runs(i);
+    if (!a || !b || a->size() != b->size())
+      return false;
+    for (size_t r = 0; r < a->size(); r++)
+      if ((*a)[r].start != (*b)[r].start || (*a)[r].end != (*b)[r].end
+          || (*a)[r].token != (*b)[r].token)
+        return false;
+  }
+  return true;
+}
+
+int main()
+{
+  const Language &c = *Language::for_file("x.c");
+
+  // Code, with a stray "*/" every 50 lines for an opened comment to end at.
+  Lines text(2000, "int x = 1; // note");
+  for (size_t i = 0; i < text.size(); i += 50)
+    text[i] = "x = 2; */ y";
+
+  Highlighter h(c);
+  auto src = source(text);
+  size_t n = h.update(src, text.size());
+  expect(n == text.size(), "first update tokenizes everything", n);
+
+  text[1000] = "float y = 2;";
+  h.edit(1000, 1, 1);
+  n = h.update(src, text.size());
+  expect(n == 1, "a one-line edit redoes one line", n);
+
+  text.insert(std::begin(text) + 1010, "/* open");
+  h.edit(1010, 0, 1);
+  n = h.update(src, text.size());
+  expect(n <= 42, "opening a comment redoes up to its end", n);
+
+  text.erase(std::begin(text) + 1010);
+  h.edit(1010, 1, 0);
+  n = h.update(src, text.size());
+  expect(n <= 42, "closing it again does the same", n);
+
+  // Past what's asked for, an edit waits for the next update that gets to it.
+  text[1500] = "char c;";
+  h.edit(1500, 1, 1);
+  n = h.update(src, 1400);
+  expect(n == 0, "an edit past `upto` isn't redone yet", n);
+  n = h.update(src, text.size());
+  expect(n == 1, "and is redone once reached", n);
+
+  expect(same_as_fresh(h, c, text), "matches a fresh tokenize", 0);
+
+  // A comment with no end changes everything after it, which goes to the
+  // pool in chunks.
+  text[3] = "/* never closed";
+  for (std::string &l : text)
+    if (l == "x = 2; */ y")
+      l = "x = 2;";
+  h.edit(3, 1, 1);
+  n = h.update(src, text.size());
+  expect(n >= text.size() - 3, "an unclosed comment redoes the rest", n);
+  expect(same_as_fresh(h, c, text), "matches after going wide", 0);
+
+  // Random edits never leave it different from a fresh tokenize.
+  std::mt19937 rng(1);
+  const char *pieces[] = {
+    "int a;", "/* x", "y */", "\"str", "str\"", "// c", "#include <x>", ""
+  };
+  for (int round = 0; round < 200; round++) {
+    size_t at = rng() % text.size();
+    size_t removed = std::min<size_t>(rng() % 3, text.size() - at);
+    size_t added = rng() % 3;
+    text.erase(std::begin(text) + at, std::begin(text) + at + removed);
+    for (size_t k = 0; k < added; k++)
+      text.insert(std::begin(text) + at, pieces[rng() % 8]);
+    h.edit(at, removed, added);
+    h.update(src, text.size());
+  }
+  expect(same_as_fresh(h, c, text), "matches after random edits", 0);
+
+  if (failures == 0)
+    std::printf("ok\n");
+  return failures ? 1 : 0;
+}